@@ -0,0 +1,209 @@
+#include "TCPBufferBudget.h"
+#include "TCPWrapperStats.h"
+
+DEFINE_STAT(STAT_TCPConnections);
+DEFINE_STAT(STAT_TCPKernelBufferMemory);
+DEFINE_STAT(STAT_TCPUserBufferMemory);
+
+namespace
+{
+	//throughput is measured over windows this long
+	const double BufferWindowSeconds = 1.0;
+
+	//quiet windows before a connection counts as idle
+	const int32 IdleWindowsBeforeTrim = 2;
+}
+
+FTCPBufferBudget::FTCPBufferBudget(int64 InBudget)
+	: Budget(InBudget)
+	, KernelBytes(0)
+	, UserBytes(0)
+	, MinimumBytes(0)
+{
+}
+
+FTCPBufferBudget::~FTCPBufferBudget()
+{
+	DEC_MEMORY_STAT_BY(STAT_TCPKernelBufferMemory, KernelBytes);
+	DEC_MEMORY_STAT_BY(STAT_TCPUserBufferMemory, UserBytes);
+}
+
+void FTCPBufferBudget::SetBudget(int64 InBudget)
+{
+	FScopeLock ScopeLock(&Lock);
+	Budget = InBudget;
+}
+
+int32 FTCPBufferBudget::ResizeKernel(int32 Current, int32 Desired, int32 Minimum)
+{
+	FScopeLock ScopeLock(&Lock);
+
+	int32 Granted = Desired;
+	if (Desired > Current && Budget > 0)
+	{
+		const int64 Available = FMath::Max<int64>(Budget - (KernelBytes - MinimumBytes) - UserBytes, 0);
+		Granted = (int32)FMath::Min<int64>(Desired, Current + Available);
+	}
+	Granted = FMath::Max(Granted, Minimum);
+
+	KernelBytes += Granted - Current;
+	if (Granted > Current)
+	{
+		INC_MEMORY_STAT_BY(STAT_TCPKernelBufferMemory, Granted - Current);
+	}
+	else
+	{
+		DEC_MEMORY_STAT_BY(STAT_TCPKernelBufferMemory, Current - Granted);
+	}
+	return Granted;
+}
+
+void FTCPBufferBudget::AddMinimumBytes(int64 Delta)
+{
+	FScopeLock ScopeLock(&Lock);
+	MinimumBytes += Delta;
+}
+
+void FTCPBufferBudget::AddUserBytes(int64 Delta)
+{
+	FScopeLock ScopeLock(&Lock);
+	UserBytes += Delta;
+	if (Delta > 0)
+	{
+		INC_MEMORY_STAT_BY(STAT_TCPUserBufferMemory, Delta);
+	}
+	else
+	{
+		DEC_MEMORY_STAT_BY(STAT_TCPUserBufferMemory, -Delta);
+	}
+}
+
+bool FTCPBufferBudget::TryAddUserBytes(int64 Bytes)
+{
+	FScopeLock ScopeLock(&Lock);
+	if (Budget > 0 && (KernelBytes - MinimumBytes) + UserBytes + Bytes > Budget)
+	{
+		return false;
+	}
+	UserBytes += Bytes;
+	INC_MEMORY_STAT_BY(STAT_TCPUserBufferMemory, Bytes);
+	return true;
+}
+
+int64 FTCPBufferBudget::GetBudget() const
+{
+	FScopeLock ScopeLock(&Lock);
+	return Budget;
+}
+
+int64 FTCPBufferBudget::GetKernelBytes() const
+{
+	FScopeLock ScopeLock(&Lock);
+	return KernelBytes;
+}
+
+int64 FTCPBufferBudget::GetUserBytes() const
+{
+	FScopeLock ScopeLock(&Lock);
+	return UserBytes;
+}
+
+FTCPAdaptiveBuffer::FTCPAdaptiveBuffer(TSharedPtr<FTCPBufferBudget, ESPMode::ThreadSafe> InBudget, int32 InMinSize, int32 InMaxSize, float InTargetLatency)
+	: Budget(InBudget)
+	, MinSize(FMath::Max(InMinSize, 4096))
+	, MaxSize(FMath::Max(InMaxSize, FMath::Max(InMinSize, 4096)))
+	, TargetLatency(FMath::Max(InTargetLatency, 0.001f))
+	, SendLimit(MaxSize)
+	, SendSize(0)
+	, ReceiveSize(0)
+	, UserBytes(0)
+	, MinimumBytes(0)
+	, WindowStart(FPlatformTime::Seconds())
+	, IdleWindows(0)
+{
+	INC_DWORD_STAT(STAT_TCPConnections);
+}
+
+FTCPAdaptiveBuffer::~FTCPAdaptiveBuffer()
+{
+	Budget->ResizeKernel(SendSize, 0, 0);
+	Budget->ResizeKernel(ReceiveSize, 0, 0);
+	Budget->AddUserBytes(-UserBytes);
+	Budget->AddMinimumBytes(-MinimumBytes);
+	DEC_DWORD_STAT(STAT_TCPConnections);
+}
+
+void FTCPAdaptiveBuffer::SetSendLimit(int32 Limit)
+{
+	SendLimit = FMath::Clamp(Limit, 4096, MaxSize);
+}
+
+void FTCPAdaptiveBuffer::Initialize(FTCPConnection& Connection)
+{
+	int32 ActualSize = 0;
+	const int32 MinSendSize = FMath::Min(MinSize, SendLimit);
+	SendSize = Budget->ResizeKernel(SendSize, MinSendSize, MinSendSize);
+	Connection.SetSendBufferSize(SendSize, ActualSize);
+
+	ReceiveSize = Budget->ResizeKernel(ReceiveSize, MinSize, MinSize);
+	Connection.SetReceiveBufferSize(ReceiveSize, ActualSize);
+
+	Budget->AddMinimumBytes(MinSendSize + MinSize - MinimumBytes);
+	MinimumBytes = MinSendSize + MinSize;
+}
+
+int32 FTCPAdaptiveBuffer::NextSize(int32 Current, int64 BytesInWindow, double Elapsed) const
+{
+	const double Rate = BytesInWindow / Elapsed;
+	const int64 Wanted = (int64)(Rate * TargetLatency);
+	const int32 Target = (int32)FMath::Clamp<int64>(FMath::RoundUpToPowerOfTwo64(FMath::Max<int64>(Wanted, 1)), MinSize, MaxSize);
+
+	//grow straight away, shrink by at most half per window so bursty traffic doesn't thrash
+	if (Target >= Current)
+	{
+		return Target;
+	}
+	return FMath::Max(Target, Current / 2);
+}
+
+bool FTCPAdaptiveBuffer::Update(FTCPConnection& Connection, double Now, int64 UserBufferBytes)
+{
+	const double Elapsed = Now - WindowStart;
+	if (Elapsed < BufferWindowSeconds)
+	{
+		return false;
+	}
+	WindowStart = Now;
+
+	if (UserBufferBytes != UserBytes)
+	{
+		Budget->AddUserBytes(UserBufferBytes - UserBytes);
+		UserBytes = UserBufferBytes;
+	}
+
+	const int64 Sent = SentInWindow.Set(0);
+	const int64 Received = ReceivedInWindow.Set(0);
+
+	int32 ActualSize = 0;
+	const int32 WantedSend = FMath::Min(NextSize(SendSize, Sent, Elapsed), SendLimit);
+	if (WantedSend != SendSize)
+	{
+		SendSize = Budget->ResizeKernel(SendSize, WantedSend, FMath::Min(MinSize, SendLimit));
+		Connection.SetSendBufferSize(SendSize, ActualSize);
+	}
+
+	const int32 WantedReceive = NextSize(ReceiveSize, Received, Elapsed);
+	if (WantedReceive != ReceiveSize)
+	{
+		ReceiveSize = Budget->ResizeKernel(ReceiveSize, WantedReceive, MinSize);
+		Connection.SetReceiveBufferSize(ReceiveSize, ActualSize);
+	}
+
+	if (Sent == 0 && Received == 0)
+	{
+		IdleWindows++;
+		return IdleWindows == IdleWindowsBeforeTrim;
+	}
+	IdleWindows = 0;
+	return false;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "TCPConnection.h"
+
+/**
+* Memory budget shared by all connections of one component. Tracks what we've asked the kernel
+* to reserve for socket buffers plus what our own buffers hold. Queued outgoing messages reserve
+* their bytes up front and are refused once the budget is used up, reassembly buffers are only
+* tracked here and bounded per message by MaxReceiveMessageSize instead.
+*
+* Every connection's minimum buffers are granted regardless and don't count against the budget, it
+* only limits growth above those minimums and queued sends. Otherwise enough idle connections would
+* use it all up and refuse every send. Connection count is limited by whoever accepts them, not here.
+*
+* Thread safe, resizes are rare (at most once per second per connection) so a lock is fine.
+*/
+class FTCPBufferBudget
+{
+public:
+	/** @param InBudget	total bytes allowed, 0 for unlimited */
+	explicit FTCPBufferBudget(int64 InBudget);
+	~FTCPBufferBudget();
+
+	void SetBudget(int64 InBudget);
+
+	/**
+	* Move a kernel buffer reservation from Current to Desired bytes. Shrinking always succeeds,
+	* growing is clamped to what's left of the budget, but never below Minimum so a connection stays usable.
+	* @return the size that was granted and is now accounted for
+	*/
+	int32 ResizeKernel(int32 Current, int32 Desired, int32 Minimum);
+
+	/** Adjust the kernel bytes that are a connection's minimum buffers and so outside the budget */
+	void AddMinimumBytes(int64 Delta);
+
+	/** Adjust the tracked user space buffer bytes by Delta */
+	void AddUserBytes(int64 Delta);
+
+	/** Reserve Bytes of user space buffer, fails without reserving anything if that would go over the budget */
+	bool TryAddUserBytes(int64 Bytes);
+
+	int64 GetBudget() const;
+	int64 GetKernelBytes() const;
+	int64 GetUserBytes() const;
+
+private:
+	mutable FCriticalSection Lock;
+	int64 Budget;
+	int64 KernelBytes;
+	int64 UserBytes;
+	int64 MinimumBytes;
+};
+
+/**
+* Per connection buffer sizing. Measures throughput over one second windows and sizes the kernel
+* buffers to hold TargetLatency seconds of it, within the component budget. Idle connections drop
+* back to the minimum and get their user space buffers trimmed.
+*
+* Limits worth knowing about:
+* - Setting a buffer size explicitly turns off the kernel's own autotuning for that socket (Linux), and
+*   the receive window scale is fixed at the handshake, so growing the receive buffer later can't
+*   advertise a window much larger than the size that was set before connecting.
+* - Rate is what the connection achieved, which is already bounded by the buffer over the round trip,
+*   so sizes only grow when TargetLatency is longer than the round trip time. On high bandwidth-delay
+*   links turn adaptive sizing off (buffers are then set to the max before connecting) or raise TargetLatency.
+*/
+class FTCPAdaptiveBuffer
+{
+public:
+	FTCPAdaptiveBuffer(TSharedPtr<FTCPBufferBudget, ESPMode::ThreadSafe> InBudget, int32 InMinSize, int32 InMaxSize, float InTargetLatency);
+	~FTCPAdaptiveBuffer();
+
+	/** Cap the kernel send buffer below MaxSize, call before Initialize */
+	void SetSendLimit(int32 Limit);
+
+	/** Apply the initial (minimum) kernel buffer sizes */
+	void Initialize(FTCPConnection& Connection);
+
+	/** Thread safe traffic counters */
+	void AddSent(int64 Bytes) { SentInWindow.Add(Bytes); }
+	void AddReceived(int64 Bytes) { ReceivedInWindow.Add(Bytes); }
+
+	/**
+	* Called regularly from the I/O thread, resizes buffers once per window.
+	* @param UserBufferBytes	this connection's current user space buffer size, folded into the budget once per window
+	* @return true once when the connection has just gone idle and user space buffers should be trimmed
+	*/
+	bool Update(FTCPConnection& Connection, double Now, int64 UserBufferBytes);
+
+	/** Largest chunk worth reading at once, matches the kernel receive buffer */
+	int32 GetReceiveChunkSize() const { return ReceiveSize; }
+
+private:
+	int32 NextSize(int32 Current, int64 BytesInWindow, double Elapsed) const;
+
+	TSharedPtr<FTCPBufferBudget, ESPMode::ThreadSafe> Budget;
+	int32 MinSize;
+	int32 MaxSize;
+	float TargetLatency;
+	int32 SendLimit;
+
+	int32 SendSize;
+	int32 ReceiveSize;
+	int64 UserBytes;
+	int64 MinimumBytes;
+
+	FThreadSafeCounter64 SentInWindow;
+	FThreadSafeCounter64 ReceivedInWindow;
+	double WindowStart;
+	int32 IdleWindows;
+};
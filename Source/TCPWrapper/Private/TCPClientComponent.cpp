@@ -5,12 +5,340 @@
 #include "SocketSubsystem.h"
 #include "Kismet/KismetSystemLibrary.h"
 #include "IPAddressAsyncResolve.h"
+#include "TCPMessageLanes.h"
+#include "TCPStreamSource.h"
+#include "TCPBufferBudget.h"
+#include "TCPConnectionDrain.h"
+#include "TCPWrapperTrace.h"
+#include "Containers/Ticker.h"
+#include "UObject/GarbageCollection.h"
+
+//frames sent each loop before we check for incoming data again
+static const int32 MaxLaneFramesPerPump = 8;
+
+//extra time the connection thread gets to close things itself before we shut its socket down under it
+static const double ShutdownCloseGrace = 0.5;
 
 TFuture<void> RunLambdaOnBackGroundThread(TFunction< void()> InFunction)
 {
 	return Async(EAsyncExecution::Thread, InFunction);
 }
 
+/**
+* Everything the connection thread touches. The thread holds a reference until it has drained, so the
+* component can be garbage collected as soon as it's unreachable and never waits on the thread.
+* Settings are copied at connect, events go back through Owner if it's still around.
+*/
+class FTCPClientSession : public TSharedFromThis<FTCPClientSession, ESPMode::ThreadSafe>
+{
+public:
+	FTCPClientSession(UTCPClientComponent* Component, FTCPConnectionPtr InConnection);
+
+	/** Connection thread body, returns once the connection has closed and drained */
+	void Run();
+
+	/** Once ShutdownDeadline has passed close the socket the connection thread may still be blocked on. Returns true while there's time left. */
+	bool CloseSocketPastDeadline();
+
+	bool IsConnected() const;
+
+	TWeakObjectPtr<UTCPClientComponent> Owner;
+	FTCPConnectionPtr Connection;
+	TSharedPtr<FTCPMessageLanes, ESPMode::ThreadSafe> Lanes;
+	TSharedPtr<FTCPAdaptiveBuffer, ESPMode::ThreadSafe> Buffers;
+	FThreadSafeBool bShouldReceiveData;
+	FThreadSafeBool bShouldAttemptConnection;
+	FThreadSafeBool bFinished;
+	double ShutdownDeadline;
+
+private:
+	/** Run Event on the game thread if the component is still alive by then */
+	void PostToOwner(TFunction<void(UTCPClientComponent*)> Event);
+
+	/** Like PostToOwner, but only while this is still the component's connection */
+	void PostToCurrentOwner(TFunction<void(UTCPClientComponent*)> Event);
+
+	/** Hand received bytes to OnReceivedBytes on the configured thread */
+	void BroadcastReceivedBytes(const TArray<uint8>& Bytes, uint32 ConnectionId);
+
+	/** Outgoing queue for the connection, wired to the component's events */
+	void CreateLanes(UTCPClientComponent* Component);
+
+	/** Buffer sizing for the connection, drawing from the component's budget */
+	void CreateBuffers(UTCPClientComponent* Component);
+
+	bool bReceiveDataOnGameThread;
+	float ShutdownTimeout;
+};
+
+FTCPClientSession::FTCPClientSession(UTCPClientComponent* Component, FTCPConnectionPtr InConnection)
+	: Owner(Component)
+	, Connection(InConnection)
+	, ShutdownDeadline(MAX_dbl)
+	, bReceiveDataOnGameThread(Component->bReceiveDataOnGameThread)
+	, ShutdownTimeout(Component->ShutdownTimeout)
+{
+	//Set Send Buffer Size, before connecting so the receive window is negotiated with it
+	CreateBuffers(Component);
+	Buffers->Initialize(*Connection);
+
+	CreateLanes(Component);
+
+	//set before the thread starts so an early CloseSocket can't be overwritten
+	bShouldAttemptConnection = true;
+	bShouldReceiveData = true;
+}
+
+void FTCPClientSession::Run()
+{
+	double LastConnectionCheck = FPlatformTime::Seconds();
+
+	uint32 BufferSize = 0;
+	TArray<uint8> ReceiveBuffer;
+
+	while (bShouldAttemptConnection)
+	{
+		if (Connection->Connect())
+		{
+			PostToOwner([](UTCPClientComponent* Component)
+			{
+				Component->OnConnected.Broadcast();
+			});
+			bShouldAttemptConnection = false;
+			continue;
+		}
+	
+		//reconnect attempt every 3 sec, waking early if CloseSocket is called meanwhile
+		const double RetryTime = FPlatformTime::Seconds() + 3.0;
+		while (bShouldAttemptConnection && FPlatformTime::Seconds() < RetryTime)
+		{
+			FPlatformProcess::Sleep(0.05f);
+		}
+	}
+
+	while (IsConnected() && bShouldReceiveData)
+	{
+		if (Connection->HasPendingData(BufferSize))
+		{
+			TCPWRAPPER_TRACE_SCOPE(Recv);
+
+			//don't grow past what the kernel buffer holds, the rest is picked up next loop
+			ReceiveBuffer.SetNumUninitialized(FMath::Min(BufferSize, (uint32)Buffers->GetReceiveChunkSize()), false);
+
+			int32 Read = 0;
+			Connection->Recv(ReceiveBuffer.GetData(), ReceiveBuffer.Num(), Read);
+			Buffers->AddReceived(Read);
+
+			if (Lanes->IsFramed())
+			{
+				//framed stream, only whole messages get broadcast
+				if (!Lanes->ReceiveBytes(ReceiveBuffer.GetData(), Read))
+				{
+					UE_LOG(LogTemp, Warning, TEXT("TCPClientComponent: malformed lane frames, disconnecting."));
+					bShouldReceiveData = false;
+					PostToCurrentOwner([](UTCPClientComponent* Component)
+					{
+						Component->CloseSocket();
+					});
+					break;
+				}
+			}
+			else
+			{
+				ReceiveBuffer.SetNum(Read, false);
+				BroadcastReceivedBytes(ReceiveBuffer, Connection->GetId());
+			}
+		}
+
+		//Flush queued lane frames and file streams
+		if (Lanes->HasPendingSends())
+		{
+			int64 BytesSent = 0;
+			const bool bPumped = Lanes->PumpSends(*Connection, MaxLaneFramesPerPump, BytesSent);
+			Buffers->AddSent(BytesSent);
+
+			if (!bPumped)
+			{
+				bShouldReceiveData = false;
+				PostToCurrentOwner([](UTCPClientComponent* Component)
+				{
+					Component->HandleSendFailure();
+				});
+				break;
+			}
+		}
+
+		//Resize socket buffers to recent throughput, trim our own once idle
+		if (Buffers->Update(*Connection, FPlatformTime::Seconds(), Lanes->GetAllocatedSize() + ReceiveBuffer.GetAllocatedSize()))
+		{
+			Lanes->Trim();
+			ReceiveBuffer.Empty();
+		}
+
+		//sleep until there is data or 10 ticks (0.1micro seconds
+		Connection->Wait(ESocketWaitConditions::WaitForReadOrWrite, FTimespan(10));
+
+		//Check every second if we're still connected
+		//NB: this doesn't really work atm, disconnects are not captured on receive pipe
+		//detectable on send failure though
+		/*double Now = FPlatformTime::Seconds();
+		if (Now > (LastConnectionCheck + 1.0)) 
+		{
+			LastConnectionCheck = Now;
+			if (!IsConnected())
+			{
+				bShouldReceiveData = false;
+				FTCPWrapperUtility::RunLambdaOnGameThread([&]() 
+				{
+					OnDisconnected.Broadcast();
+				});
+				
+			}
+		}*/
+	}
+
+	//Flush whatever is still queued and close cleanly, a failed connection just closes
+	TArray<FTCPConnectionDrain> Drains;
+	Drains.Emplace(Connection, Lanes);
+	FTCPConnectionDrain::DrainAll(Drains, FPlatformTime::Seconds() + ShutdownTimeout);
+	bFinished = true;
+
+	TSharedRef<FTCPClientSession, ESPMode::ThreadSafe> Self = AsShared();
+	PostToOwner([Self](UTCPClientComponent* Component)
+	{
+		Component->FinishShutdown(Self);
+	});
+}
+
+bool FTCPClientSession::CloseSocketPastDeadline()
+{
+	if (bFinished)
+	{
+		return false;
+	}
+	if (FPlatformTime::Seconds() < ShutdownDeadline)
+	{
+		return true;
+	}
+
+	//shutting the socket down makes a blocked send/sendfile return, the connection thread then finishes up
+	UE_LOG(LogTemp, Warning, TEXT("TCPClientComponent: connection thread is still draining past ShutdownTimeout, closing the socket."));
+	Connection->Close();
+	return false;
+}
+
+bool FTCPClientSession::IsConnected() const
+{
+	return Connection->GetConnectionState() == ESocketConnectionState::SCS_Connected;
+}
+
+void FTCPClientSession::PostToOwner(TFunction<void(UTCPClientComponent*)> Event)
+{
+	TWeakObjectPtr<UTCPClientComponent> WeakOwner = Owner;
+	AsyncTask(ENamedThreads::GameThread, [WeakOwner, Event]()
+	{
+		if (WeakOwner.IsValid())
+		{
+			Event(WeakOwner.Get());
+		}
+	});
+}
+
+void FTCPClientSession::PostToCurrentOwner(TFunction<void(UTCPClientComponent*)> Event)
+{
+	//a closed or replaced connection must not act on the component anymore
+	TSharedRef<FTCPClientSession, ESPMode::ThreadSafe> Self = AsShared();
+	PostToOwner([Self, Event](UTCPClientComponent* Component)
+	{
+		if (Component->Session.Get() == &Self.Get())
+		{
+			Event(Component);
+		}
+	});
+}
+
+void FTCPClientSession::BroadcastReceivedBytes(const TArray<uint8>& Bytes, uint32 ConnectionId)
+{
+	const uint64 ReceiveCycle = FPlatformTime::Cycles64();
+	TCPWRAPPER_TRACE_MESSAGE(MessageReceived, ConnectionId, Bytes.Num(), ReceiveCycle);
+
+	if (bReceiveDataOnGameThread)
+	{
+		//Copy buffer so it's still valid on game thread
+		TArray<uint8> ReceiveBufferGT;
+		ReceiveBufferGT.Append(Bytes);
+
+		//Pass the reference to be used on game thread
+		PostToOwner([ReceiveBufferGT, ConnectionId, ReceiveCycle](UTCPClientComponent* Component)
+		{
+			TCPWRAPPER_TRACE_SCOPE(Dispatch);
+			TCPWRAPPER_TRACE_MESSAGE(MessageDispatched, ConnectionId, ReceiveBufferGT.Num(), ReceiveCycle);
+			Component->OnReceivedBytes.Broadcast(ReceiveBufferGT);
+		});
+	}
+	else
+	{
+		//garbage collection waits for the guard, so the component can't go away mid broadcast
+		FGCScopeGuard GCGuard;
+		if (UTCPClientComponent* Component = Owner.Get())
+		{
+			TCPWRAPPER_TRACE_SCOPE(Dispatch);
+			TCPWRAPPER_TRACE_MESSAGE(MessageDispatched, ConnectionId, Bytes.Num(), ReceiveCycle);
+			Component->OnReceivedBytes.Broadcast(Bytes);
+		}
+	}
+}
+
+void FTCPClientSession::CreateLanes(UTCPClientComponent* Component)
+{
+	const uint32 ConnectionId = Connection->GetId();
+	Lanes = MakeShareable(new FTCPMessageLanes(Component->bUsePriorityLanes, Component->LaneFrameSize, Component->LaneScheduling, Component->LaneWeights));
+	Lanes->ReceiveDirectory = Component->ReceiveFileDirectory;
+	Lanes->ConnectionId = ConnectionId;
+	Lanes->MaxMessageSize = Component->MaxReceiveMessageSize;
+	Lanes->Budget = Component->BufferBudget;
+
+	//callbacks run on the connection thread, which keeps us alive, the component might not be by then
+	Lanes->OnMessage = [this, ConnectionId](TArray<uint8>& Message, ETCPMessagePriority Priority)
+	{
+		BroadcastReceivedBytes(Message, ConnectionId);
+	};
+	Lanes->OnFileReceived = [this](const FString& Path)
+	{
+		PostToOwner([Path](UTCPClientComponent* Component)
+		{
+			Component->OnReceivedFile.Broadcast(Path);
+		});
+	};
+	Lanes->OnSendProgress = [this](int32 TransferId, int64 Bytes, int64 Total)
+	{
+		PostToOwner([TransferId, Bytes, Total](UTCPClientComponent* Component)
+		{
+			Component->OnSendProgress.Broadcast(TransferId, Bytes, Total);
+		});
+	};
+	Lanes->OnReceiveProgress = [this](int32 TransferId, int64 Bytes, int64 Total)
+	{
+		PostToOwner([TransferId, Bytes, Total](UTCPClientComponent* Component)
+		{
+			Component->OnReceiveProgress.Broadcast(TransferId, Bytes, Total);
+		});
+	};
+}
+
+void FTCPClientSession::CreateBuffers(UTCPClientComponent* Component)
+{
+	//fixed sizing is just adaptive sizing with nowhere to move
+	const int32 MinSize = Component->bAdaptiveBufferSizing ? Component->MinBufferSize : Component->BufferMaxSize;
+	Buffers = MakeShareable(new FTCPAdaptiveBuffer(Component->BufferBudget, MinSize, Component->BufferMaxSize, Component->BufferTargetLatency));
+
+	if (Component->bUsePriorityLanes)
+	{
+		//whatever sits in the kernel send buffer goes out ahead of any control frame, keep it to a few frames
+		Buffers->SetSendLimit(FTCPMessageLanes::SendBufferFrames * (Component->LaneFrameSize + FTCPMessageLanes::FrameHeaderSize));
+	}
+}
+
 UTCPClientComponent::UTCPClientComponent(const FObjectInitializer &init) : UActorComponent(init)
 {
 	bShouldAutoConnectOnBeginPlay = true;
@@ -22,180 +350,236 @@ UTCPClientComponent::UTCPClientComponent(const FObjectInitializer &init) : UActo
 	ConnectionIP = FString(TEXT("127.0.0.1"));
 	ConnectionPort = 3000;
 	ClientSocketName = FString(TEXT("unreal-tcp-client"));
-	ClientSocket = nullptr;
+	bUseUnixDomainSocket = false;
+	UnixSocketPath = FString(TEXT("/tmp/ue4-tcp.sock"));
+	bUseSharedMemoryRing = false;
+	SharedMemoryRingSize = 8 * 1024 * 1024;
+	bUsePriorityLanes = false;
+	LaneFrameSize = 16 * 1024;
+	LaneScheduling = ETCPLaneScheduling::Strict;
+	LaneWeights = { 8, 4, 1 };
+	MaxReceiveMessageSize = 64 * 1024 * 1024;
+	bConnectAfterShutdown = false;
+	PendingConnectPort = 0;
+	bHasEndedPlay = false;
 
 	BufferMaxSize = 2 * 1024 * 1024;	//default roughly 2mb
+	bAdaptiveBufferSizing = true;
+	MinBufferSize = 64 * 1024;
+	BufferTargetLatency = 0.1f;
+	MemoryBudgetMB = 64;
+	ShutdownTimeout = 2.f;
+	BufferBudget = MakeShareable(new FTCPBufferBudget(0));
 }
 
 void UTCPClientComponent::ConnectToSocketAsClient(const FString& InIP /*= TEXT("127.0.0.1")*/, const int32 InPort /*= 3000*/)
 {
-	//Already connected? attempt reconnect
-	if (IsConnected())
+	//an ended component would never close the connection again
+	if (bHasEndedPlay)
 	{
-		CloseSocket();
-		ConnectToSocketAsClient(InIP, InPort);
+		UE_LOG(LogTemp, Warning, TEXT("TCPClientComponent: not connecting after EndPlay."));
+		return;
 	}
 
-	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
-
-	if (SocketSubsystem == nullptr)
-    {
-        UE_LOG(LogTemp, Error, TEXT("TCPClientComponent: SocketSubsystem is nullptr"));
-        return;
-    }
-
-	auto ResolveInfo = SocketSubsystem->GetHostByName(TCHAR_TO_ANSI(*InIP));
-	while (!ResolveInfo->IsComplete());
-
-	auto error = ResolveInfo->GetErrorCode();
-
-	if (error != 0)
-    {
-        UE_LOG(LogTemp, Error, TEXT("TCPClientComponent: DNS resolve error code %d"), error);
-        return;
-    }
-
-	RemoteAdress = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr();
-
-	RemoteAdress->SetRawIp(ResolveInfo->GetResolvedAddress().GetRawIp()); // todo: somewhat wasteful, we could probably use the same address object?
-	RemoteAdress->SetPort(InPort);
+	//Already connected or connecting? reconnect once that connection has shut down
+	if (Session.IsValid())
+	{
+		CloseSocket();
+	}
+	if (bIsShuttingDown)
+	{
+		bConnectAfterShutdown = true;
+		PendingConnectIP = InIP;
+		PendingConnectPort = InPort;
+		return;
+	}
 
-	ClientSocket = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateSocket(NAME_Stream, ClientSocketName, false);
+	FTCPConnectionPtr ClientSocket;
+	if (bUseUnixDomainSocket)
+	{
+		ClientSocket = bUseSharedMemoryRing ? FTCPConnection::CreateSharedMemoryRing(UnixSocketPath, SharedMemoryRingSize) : FTCPConnection::CreateUnixSocket(UnixSocketPath);
+		if (!ClientSocket.IsValid())
+		{
+			UE_LOG(LogTemp, Error, TEXT("TCPClientComponent: unable to create unix socket for %s"), *UnixSocketPath);
+			return;
+		}
+	}
+	else
+	{
+		ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
 
-	//Set Send Buffer Size
-	ClientSocket->SetSendBufferSize(BufferMaxSize, BufferMaxSize);
-	ClientSocket->SetReceiveBufferSize(BufferMaxSize, BufferMaxSize);
+		if (SocketSubsystem == nullptr)
+		{
+			UE_LOG(LogTemp, Error, TEXT("TCPClientComponent: SocketSubsystem is nullptr"));
+			return;
+		}
 
-	//Listen for data on our end
-	ClientConnectionFinishedFuture = FTCPWrapperUtility::RunLambdaOnBackGroundThread([&]()
-	{
-		double LastConnectionCheck = FPlatformTime::Seconds();
+		auto ResolveInfo = SocketSubsystem->GetHostByName(TCHAR_TO_ANSI(*InIP));
+		while (!ResolveInfo->IsComplete());
 
-		uint32 BufferSize = 0;
-		TArray<uint8> ReceiveBuffer;
-		bShouldAttemptConnection = true;
+		auto error = ResolveInfo->GetErrorCode();
 
-		while (bShouldAttemptConnection)
+		if (error != 0)
 		{
-			if (ClientSocket->Connect(*RemoteAdress))
-			{
-				FTCPWrapperUtility::RunLambdaOnGameThread([&]()
-				{
-					OnConnected.Broadcast();
-				});
-				bShouldAttemptConnection = false;
-				continue;
-			}
-		
-			//reconnect attempt every 3 sec
-			FPlatformProcess::Sleep(3.f);
+			UE_LOG(LogTemp, Error, TEXT("TCPClientComponent: DNS resolve error code %d"), error);
+			return;
 		}
 
-		bShouldReceiveData = true;
+		RemoteAdress = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr();
 
-		while (IsConnected() && bShouldReceiveData)
-		{
-			if (ClientSocket->HasPendingData(BufferSize))
-			{
-				ReceiveBuffer.SetNumUninitialized(BufferSize);
+		RemoteAdress->SetRawIp(ResolveInfo->GetResolvedAddress().GetRawIp()); // todo: somewhat wasteful, we could probably use the same address object?
+		RemoteAdress->SetPort(InPort);
 
-				int32 Read = 0;
-				ClientSocket->Recv(ReceiveBuffer.GetData(), ReceiveBuffer.Num(), Read);
+		ClientSocket = FTCPConnection::FromSocket(SocketSubsystem->CreateSocket(NAME_Stream, ClientSocketName, false), RemoteAdress);
+	}
 
-				if (bReceiveDataOnGameThread)
-				{
-					//Copy buffer so it's still valid on game thread
-					TArray<uint8> ReceiveBufferGT;
-					ReceiveBufferGT.Append(ReceiveBuffer);
+	BufferBudget->SetBudget((int64)MemoryBudgetMB * 1024 * 1024);
+	Session = MakeShareable(new FTCPClientSession(this, ClientSocket));
 
-					//Pass the reference to be used on game thread
-					AsyncTask(ENamedThreads::GameThread, [&, ReceiveBufferGT]()
-					{
-						OnReceivedBytes.Broadcast(ReceiveBufferGT);
-					});
-				}
-				else
-				{
-					OnReceivedBytes.Broadcast(ReceiveBuffer);
-				}
-			}
-			//sleep until there is data or 10 ticks (0.1micro seconds
-			ClientSocket->Wait(ESocketWaitConditions::WaitForReadOrWrite, FTimespan(10));
-
-			//Check every second if we're still connected
-			//NB: this doesn't really work atm, disconnects are not captured on receive pipe
-			//detectable on send failure though
-			/*double Now = FPlatformTime::Seconds();
-			if (Now > (LastConnectionCheck + 1.0)) 
-			{
-				LastConnectionCheck = Now;
-				if (!IsConnected())
-				{
-					bShouldReceiveData = false;
-					FTCPWrapperUtility::RunLambdaOnGameThread([&]() 
-					{
-						OnDisconnected.Broadcast();
-					});
-					
-				}
-			}*/
-		}
+	//Listen for data on our end, the thread owns the session from here on
+	TSharedPtr<FTCPClientSession, ESPMode::ThreadSafe> NewSession = Session;
+	FTCPWrapperUtility::RunLambdaOnBackGroundThread([NewSession]()
+	{
+		NewSession->Run();
 	});
 }
 
 void UTCPClientComponent::CloseSocket()
 {
-	if (ClientSocket)
+	if (Session.IsValid())
 	{
-		bShouldReceiveData = false;
-		bShouldAttemptConnection = false;
-		
-		if (ClientConnectionFinishedFuture.IsValid())
+		//the connection thread drains and closes the socket, we don't wait for it
+		bIsShuttingDown = true;
+		Session->bShouldReceiveData = false;
+		Session->bShouldAttemptConnection = false;
+
+		//a blocking send to a server that stopped reading would outlast the thread's own deadline, close under it if so.
+		//The ticker only holds the session, so this still happens after we've been destroyed.
+		Session->ShutdownDeadline = FPlatformTime::Seconds() + ShutdownTimeout + ShutdownCloseGrace;
+		TSharedPtr<FTCPClientSession, ESPMode::ThreadSafe> ClosedSession = Session;
+		FTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([ClosedSession](float DeltaTime)
 		{
-			auto Status = ClientConnectionFinishedFuture.WaitFor(FTimespan::FromSeconds(3.f));
-		}
+			return ClosedSession->CloseSocketPastDeadline();
+		}));
+
+		//a draining connection isn't ours anymore, nothing new gets queued on it
+		Session.Reset();
+	}
+}
 
-		ClientSocket->Close();
-		ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(ClientSocket);
-		ClientSocket = nullptr;
+void UTCPClientComponent::FinishShutdown(TSharedPtr<FTCPClientSession, ESPMode::ThreadSafe> FinishedSession)
+{
+	//the connection may have ended without CloseSocket, e.g. the server went away
+	if (Session == FinishedSession)
+	{
+		Session.Reset();
+	}
+	bIsShuttingDown = false;
+
+	OnDisconnected.Broadcast();
+	OnShutdownComplete.Broadcast();
 
-		OnDisconnected.Broadcast();
+	if (bConnectAfterShutdown && !bHasEndedPlay)
+	{
+		bConnectAfterShutdown = false;
+		ConnectToSocketAsClient(PendingConnectIP, PendingConnectPort);
 	}
 }
 
-bool UTCPClientComponent::Emit(const TArray<uint8>& Bytes)
+bool UTCPClientComponent::Emit(const TArray<uint8>& Bytes, ETCPMessagePriority Priority)
 {
 	if (IsConnected())
 	{
+		if (Session->Lanes->IsFramed() || Session->Lanes->HasPendingSends())
+		{
+			//frames are sent from the connection thread, failures are handled there
+			TArray<uint8> Message = Bytes;
+			return Session->Lanes->Enqueue(MoveTemp(Message), Priority);
+		}
+
+		TCPWRAPPER_TRACE_SCOPE(Send);
+		const uint64 SendCycle = FPlatformTime::Cycles64();
 		int32 BytesSent = 0;
-		bool bDidSend = ClientSocket->Send(Bytes.GetData(), Bytes.Num(), BytesSent);
+		bool bDidSend = Session->Connection->Send(Bytes.GetData(), Bytes.Num(), BytesSent);
+		Session->Buffers->AddSent(BytesSent);
+		if (bDidSend)
+		{
+			TCPWRAPPER_TRACE_MESSAGE(MessageSent, Session->Connection->GetId(), (uint8)Priority, Bytes.Num(), SendCycle, SendCycle);
+		}
 		
 
 		//If we're supposedly connected but failed to send
 		if (IsConnected() && !bDidSend)
 		{
-			UE_LOG(LogTemp, Warning, TEXT("Sending Failure detected"));
-
-			if (bAutoDisconnectOnSendFailure)
-			{
-				UE_LOG(LogTemp, Warning, TEXT("disconnecting socket."));
-				CloseSocket();
-			}
-
-			if (bAutoReconnectOnSendFailure)
-			{
-				UE_LOG(LogTemp, Warning, TEXT("reconnecting..."));
-				ConnectToSocketAsClient(ConnectionIP, ConnectionPort);
-			}
+			HandleSendFailure();
 		}
 		return bDidSend;
 	}
 	return false;
 }
 
+int32 UTCPClientComponent::EmitFile(const FString& FilePath, ETCPMessagePriority Priority)
+{
+	if (!IsConnected())
+	{
+		return INDEX_NONE;
+	}
+
+	FTCPStreamSourcePtr Source = FTCPStreamSource::OpenFile(FilePath);
+	if (!Source.IsValid())
+	{
+		return INDEX_NONE;
+	}
+
+	const int32 TransferId = TransferCount.Increment();
+	Session->Lanes->EnqueueStream(Source, Priority, TransferId);
+	return TransferId;
+}
+
+int32 UTCPClientComponent::EmitStream(TUniquePtr<IFileHandle> Handle, ETCPMessagePriority Priority)
+{
+	FTCPStreamSourcePtr Source = FTCPStreamSource::FromHandle(MoveTemp(Handle));
+	if (!IsConnected() || !Source.IsValid())
+	{
+		return INDEX_NONE;
+	}
+
+	const int32 TransferId = TransferCount.Increment();
+	Session->Lanes->EnqueueStream(Source, Priority, TransferId);
+	return TransferId;
+}
+
+FTCPMemoryStats UTCPClientComponent::GetMemoryStats()
+{
+	FTCPMemoryStats Stats;
+	Stats.Connections = IsConnected() ? 1 : 0;
+	Stats.KernelBufferBytes = BufferBudget->GetKernelBytes();
+	Stats.UserBufferBytes = BufferBudget->GetUserBytes();
+	Stats.MemoryBudget = BufferBudget->GetBudget();
+	return Stats;
+}
+
+void UTCPClientComponent::HandleSendFailure()
+{
+	UE_LOG(LogTemp, Warning, TEXT("Sending Failure detected"));
+
+	if (bAutoDisconnectOnSendFailure)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("disconnecting socket."));
+		CloseSocket();
+	}
+
+	//a failure reported after EndPlay must not bring the connection back
+	if (bAutoReconnectOnSendFailure && !bHasEndedPlay)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("reconnecting..."));
+		ConnectToSocketAsClient(ConnectionIP, ConnectionPort);
+	}
+}
+
 bool UTCPClientComponent::IsConnected()
 {
-	return (ClientSocket && (ClientSocket->GetConnectionState() == ESocketConnectionState::SCS_Connected));
+	return (!bIsShuttingDown && Session.IsValid() && Session->IsConnected());
 }
 
 void UTCPClientComponent::InitializeComponent()
@@ -212,6 +596,7 @@ void UTCPClientComponent::BeginPlay()
 {
 	Super::BeginPlay();
 
+	bHasEndedPlay = false;
 	if (bShouldAutoConnectOnBeginPlay)
 	{
 		ConnectToSocketAsClient(ConnectionIP, ConnectionPort);
@@ -220,6 +605,8 @@ void UTCPClientComponent::BeginPlay()
 
 void UTCPClientComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
 {
+	bHasEndedPlay = true;
+	bConnectAfterShutdown = false;
 	CloseSocket();
 
 	Super::EndPlay(EndPlayReason);
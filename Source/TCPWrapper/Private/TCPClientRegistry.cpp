@@ -0,0 +1,66 @@
+#include "TCPClientRegistry.h"
+#include "TCPServerComponent.h"
+
+FTCPClientRegistry::FTCPClientRegistry()
+	: Current(MakeShareable(new FTCPClientMap()))
+{
+}
+
+FTCPClientSnapshot FTCPClientRegistry::Snapshot() const
+{
+	FRWScopeLock ScopeLock(VersionLock, SLT_ReadOnly);
+	return Current;
+}
+
+FTCPClientPtr FTCPClientRegistry::Find(const FString& Address) const
+{
+	FTCPClientSnapshot Clients = Snapshot();
+	const FTCPClientPtr* Client = Clients->Find(Address);
+	return Client ? *Client : nullptr;
+}
+
+int32 FTCPClientRegistry::Num() const
+{
+	return Snapshot()->Num();
+}
+
+void FTCPClientRegistry::Add(const FString& Address, FTCPClientPtr Client)
+{
+	FScopeLock ScopeLock(&WriteLock);
+
+	TSharedRef<FTCPClientMap, ESPMode::ThreadSafe> NewVersion = MakeShareable(new FTCPClientMap(*Snapshot()));
+	NewVersion->Add(Address, Client);
+	Publish(NewVersion);
+}
+
+FTCPClientPtr FTCPClientRegistry::Remove(const FString& Address)
+{
+	FScopeLock ScopeLock(&WriteLock);
+
+	FTCPClientSnapshot OldVersion = Snapshot();
+	const FTCPClientPtr* Client = OldVersion->Find(Address);
+	if (!Client)
+	{
+		return nullptr;
+	}
+
+	TSharedRef<FTCPClientMap, ESPMode::ThreadSafe> NewVersion = MakeShareable(new FTCPClientMap(*OldVersion));
+	NewVersion->Remove(Address);
+	Publish(NewVersion);
+	return *Client;
+}
+
+FTCPClientSnapshot FTCPClientRegistry::Empty()
+{
+	FScopeLock ScopeLock(&WriteLock);
+
+	FTCPClientSnapshot OldVersion = Snapshot();
+	Publish(MakeShareable(new FTCPClientMap()));
+	return OldVersion;
+}
+
+void FTCPClientRegistry::Publish(const FTCPClientSnapshot& NewVersion)
+{
+	FRWScopeLock ScopeLock(VersionLock, SLT_Write);
+	Current = NewVersion;
+}
@@ -0,0 +1,132 @@
+#include "TCPConnection.h"
+#include "SocketSubsystem.h"
+#include "TCPUnixSocket.h"
+#include "TCPSharedMemoryRing.h"
+
+static FThreadSafeCounter NextConnectionId;
+
+FTCPConnection::FTCPConnection()
+	: Id((uint32)NextConnectionId.Increment())
+{
+}
+
+/** FTCPConnection over an engine FSocket */
+class FTCPSocketConnection : public FTCPConnection
+{
+public:
+	FTCPSocketConnection(FSocket* InSocket, TSharedPtr<FInternetAddr> InRemoteAddress)
+		: Socket(InSocket)
+		, RemoteAddress(InRemoteAddress)
+		, bClosed(false)
+	{
+	}
+
+	virtual ~FTCPSocketConnection()
+	{
+		if (Socket)
+		{
+			Socket->Close();
+			ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(Socket);
+			Socket = nullptr;
+		}
+	}
+
+	virtual bool Connect() override
+	{
+		return Socket && RemoteAddress.IsValid() && Socket->Connect(*RemoteAddress);
+	}
+
+	virtual bool Send(const uint8* Data, int32 Count, int32& BytesSent) override
+	{
+		return !bClosed && Socket && Socket->Send(Data, Count, BytesSent);
+	}
+
+	virtual bool Recv(uint8* Data, int32 BufferSize, int32& BytesRead) override
+	{
+		return !bClosed && Socket && Socket->Recv(Data, BufferSize, BytesRead);
+	}
+
+	virtual bool HasPendingData(uint32& PendingDataSize) override
+	{
+		return !bClosed && Socket && Socket->HasPendingData(PendingDataSize);
+	}
+
+	virtual bool Wait(ESocketWaitConditions::Type Condition, FTimespan WaitTime) override
+	{
+		return Socket && Socket->Wait(Condition, WaitTime);
+	}
+
+	virtual ESocketConnectionState GetConnectionState() override
+	{
+		return (!bClosed && Socket) ? Socket->GetConnectionState() : ESocketConnectionState::SCS_NotConnected;
+	}
+
+	virtual bool SetSendBufferSize(int32 Size, int32& NewSize) override
+	{
+		return Socket && Socket->SetSendBufferSize(Size, NewSize);
+	}
+
+	virtual bool SetReceiveBufferSize(int32 Size, int32& NewSize) override
+	{
+		return Socket && Socket->SetReceiveBufferSize(Size, NewSize);
+	}
+
+	virtual bool Shutdown(ESocketShutdownMode Mode) override
+	{
+		return Socket && Socket->Shutdown(Mode);
+	}
+
+	virtual bool Close() override
+	{
+		if (Socket && !bClosed)
+		{
+			bClosed = true;
+			Socket->Shutdown(ESocketShutdownMode::ReadWrite);
+			return true;
+		}
+		return false;
+	}
+
+private:
+	FSocket* Socket;
+	TSharedPtr<FInternetAddr> RemoteAddress;
+	FThreadSafeBool bClosed;
+};
+
+FTCPConnectionPtr FTCPConnection::FromSocket(FSocket* Socket, TSharedPtr<FInternetAddr> RemoteAddress)
+{
+	if (Socket == nullptr)
+	{
+		return nullptr;
+	}
+	return MakeShareable(new FTCPSocketConnection(Socket, RemoteAddress));
+}
+
+FTCPConnectionPtr FTCPConnection::CreateUnixSocket(const FString& Path)
+{
+#if TCPWRAPPER_WITH_UNIX_SOCKETS
+	return FTCPUnixConnection::Create(Path);
+#else
+	UE_LOG(LogTemp, Error, TEXT("TCPConnection: unix domain sockets are not supported on this platform"));
+	return nullptr;
+#endif
+}
+
+FTCPConnectionPtr FTCPConnection::CreateSharedMemoryRing(const FString& Path, int32 RingSize)
+{
+#if TCPWRAPPER_WITH_SHARED_MEMORY_RING
+	return FTCPSharedMemoryConnection::Create(Path, RingSize);
+#else
+	UE_LOG(LogTemp, Error, TEXT("TCPConnection: shared memory rings are not supported on this platform"));
+	return nullptr;
+#endif
+}
+
+FTCPConnectionPtr FTCPConnection::AcceptSharedMemoryRing(FTCPConnectionPtr UnixConnection)
+{
+#if TCPWRAPPER_WITH_SHARED_MEMORY_RING
+	return FTCPSharedMemoryConnection::FromAccepted(UnixConnection);
+#else
+	return nullptr;
+#endif
+}
@@ -0,0 +1,107 @@
+#include "TCPConnectionDrain.h"
+#include "TCPMessageLanes.h"
+#include "TCPWrapperTrace.h"
+
+//frames flushed per connection each tick, keeps one big transfer from holding up the others
+static const int32 MaxDrainFramesPerTick = 8;
+
+FTCPConnectionDrain::FTCPConnectionDrain(FTCPConnectionPtr InConnection, TSharedPtr<FTCPMessageLanes, ESPMode::ThreadSafe> InLanes)
+	: Connection(InConnection)
+	, Lanes(InLanes)
+	, State(InConnection.IsValid() ? EState::Flushing : EState::Closed)
+{
+}
+
+bool FTCPConnectionDrain::Tick()
+{
+	if (State == EState::Flushing)
+	{
+		if (Connection->GetConnectionState() != ESocketConnectionState::SCS_Connected)
+		{
+			Finish();
+			return true;
+		}
+
+		if (Lanes.IsValid() && Lanes->HasPendingSends())
+		{
+			int64 BytesSent = 0;
+			if (!Lanes->PumpSends(*Connection, MaxDrainFramesPerTick, BytesSent))
+			{
+				Finish();
+				return true;
+			}
+			return false;
+		}
+
+		//everything is out, let the peer know we're done talking
+		if (!Connection->Shutdown(ESocketShutdownMode::Write))
+		{
+			Finish();
+			return true;
+		}
+		State = EState::Lingering;
+	}
+
+	if (State == EState::Lingering)
+	{
+		//readable with nothing to read means the peer closed its side too
+		uint8 Discard[1024];
+		while (Connection->Wait(ESocketWaitConditions::WaitForRead, FTimespan::Zero()))
+		{
+			int32 Read = 0;
+			if (!Connection->Recv(Discard, sizeof(Discard), Read) || Read <= 0)
+			{
+				Finish();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	return State == EState::Closed;
+}
+
+void FTCPConnectionDrain::Abort()
+{
+	if (State != EState::Closed)
+	{
+		Finish();
+	}
+}
+
+void FTCPConnectionDrain::Finish()
+{
+	Connection->Close();
+	State = EState::Closed;
+}
+
+void FTCPConnectionDrain::DrainAll(TArray<FTCPConnectionDrain>& Drains, double Deadline)
+{
+	TCPWRAPPER_TRACE_SCOPE(Shutdown);
+
+	while (Drains.Num() > 0 && FPlatformTime::Seconds() < Deadline)
+	{
+		for (int32 Index = Drains.Num() - 1; Index >= 0; --Index)
+		{
+			if (Drains[Index].Tick())
+			{
+				Drains.RemoveAtSwap(Index, 1, false);
+			}
+		}
+
+		if (Drains.Num() > 0)
+		{
+			FPlatformProcess::Sleep(0.001);
+		}
+	}
+
+	if (Drains.Num() > 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("TCPConnectionDrain: %d connection(s) didn't close before the shutdown deadline, closing them now."), Drains.Num());
+	}
+	for (FTCPConnectionDrain& Drain : Drains)
+	{
+		Drain.Abort();
+	}
+	Drains.Empty();
+}
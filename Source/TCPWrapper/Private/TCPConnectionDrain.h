@@ -0,0 +1,44 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "TCPConnection.h"
+
+class FTCPMessageLanes;
+
+/**
+* Graceful close of a single connection: flush whatever is still queued in its lanes, half-close
+* our side so the peer sees a clean end of stream, then wait for the peer to close theirs. Anything
+* the peer still sends meanwhile is read and dropped.
+*/
+class FTCPConnectionDrain
+{
+public:
+	FTCPConnectionDrain(FTCPConnectionPtr InConnection, TSharedPtr<FTCPMessageLanes, ESPMode::ThreadSafe> InLanes);
+
+	/** Make progress without blocking, returns true once the connection is closed */
+	bool Tick();
+
+	/** Give up waiting and close now */
+	void Abort();
+
+	/**
+	* Tick all drains until they are done or Deadline (FPlatformTime::Seconds) passes, then close whatever is left.
+	* Blocks the calling thread so only call this from a socket thread. A send already under way can still
+	* block past Deadline, closing the connection from another thread makes it return.
+	*/
+	static void DrainAll(TArray<FTCPConnectionDrain>& Drains, double Deadline);
+
+private:
+	enum class EState : uint8
+	{
+		Flushing,
+		Lingering,
+		Closed
+	};
+
+	void Finish();
+
+	FTCPConnectionPtr Connection;
+	TSharedPtr<FTCPMessageLanes, ESPMode::ThreadSafe> Lanes;
+	EState State;
+};
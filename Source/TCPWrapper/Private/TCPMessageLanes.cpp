@@ -0,0 +1,527 @@
+#include "TCPMessageLanes.h"
+#include "HAL/PlatformFilemanager.h"
+#include "Misc/Paths.h"
+#include "TCPWrapperTrace.h"
+#include "TCPBufferBudget.h"
+
+namespace
+{
+	//don't trust the advertised message size for more than this up front, the array still grows as frames arrive
+	const uint64 MaxInitialReserve = 64 * 1024 * 1024;
+
+	void WriteHeader(uint8* Out, uint8 Lane, uint8 Flags, uint32 PayloadSize, uint64 MessageSize)
+	{
+		Out[0] = Lane;
+		Out[1] = Flags;
+		Out[2] = 0;
+		Out[3] = 0;
+		for (int32 i = 0; i < 4; i++)
+		{
+			Out[4 + i] = (uint8)(PayloadSize >> (8 * i));
+		}
+		for (int32 i = 0; i < 8; i++)
+		{
+			Out[8 + i] = (uint8)(MessageSize >> (8 * i));
+		}
+	}
+
+	uint32 ReadUInt32(const uint8* In)
+	{
+		return (uint32)In[0] | ((uint32)In[1] << 8) | ((uint32)In[2] << 16) | ((uint32)In[3] << 24);
+	}
+
+	uint64 ReadUInt64(const uint8* In)
+	{
+		return (uint64)ReadUInt32(In) | ((uint64)ReadUInt32(In + 4) << 32);
+	}
+
+	//report progress roughly every percent, but not more often than once per MB
+	int64 ProgressStep(int64 Total)
+	{
+		return FMath::Max<int64>(1024 * 1024, Total / 100);
+	}
+}
+
+FTCPMessageLanes::FTCPMessageLanes(bool bInFramed, int32 InFrameSize, ETCPLaneScheduling InScheduling, const TArray<int32>& InWeights)
+	: ConnectionId(0)
+	, MaxMessageSize(64 * 1024 * 1024)
+	, bFramed(bInFramed)
+	, FrameSize(FMath::Clamp(InFrameSize, 512, MaxFramePayload))
+	, Scheduling(InScheduling)
+	, ReceiveTransferCount(0)
+	, HeaderFilled(0)
+	, PayloadRemaining(0)
+	, PayloadLane(0)
+	, PayloadFlags(0)
+{
+	for (int32 Lane = 0; Lane < NumLanes; Lane++)
+	{
+		Outgoing[Lane].Offset = 0;
+		Outgoing[Lane].LastProgress = 0;
+		Outgoing[Lane].DequeueCycle = 0;
+		Outgoing[Lane].bHasCurrent = false;
+		Outgoing[Lane].Weight = InWeights.IsValidIndex(Lane) ? FMath::Max(InWeights[Lane], 1) : 1;
+		Outgoing[Lane].CurrentWeight = 0;
+
+		Incoming[Lane].TransferId = 0;
+		Incoming[Lane].Received = 0;
+		Incoming[Lane].Total = 0;
+		Incoming[Lane].LastProgress = 0;
+		Incoming[Lane].bInMessage = false;
+		Incoming[Lane].bDiscard = false;
+	}
+}
+
+FTCPMessageLanes::~FTCPMessageLanes()
+{
+	//don't leave half written transfers behind
+	for (int32 Lane = 0; Lane < NumLanes; Lane++)
+	{
+		if (Incoming[Lane].FileWriter.IsValid())
+		{
+			Incoming[Lane].FileWriter.Reset();
+			FPlatformFileManager::Get().GetPlatformFile().DeleteFile(*Incoming[Lane].FilePath);
+		}
+	}
+
+	//hand back what unsent messages had reserved
+	if (Budget.IsValid())
+	{
+		Budget->AddUserBytes(-QueuedBytes.GetValue());
+	}
+}
+
+bool FTCPMessageLanes::Enqueue(TArray<uint8>&& Bytes, ETCPMessagePriority Priority)
+{
+	const int32 Lane = LaneFor(Priority);
+
+	if (Budget.IsValid() && !Budget->TryAddUserBytes(Bytes.Num()))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("TCPMessageLanes: memory budget used up, refusing %d byte message"), Bytes.Num());
+		return false;
+	}
+
+	FOutgoingMessage Message;
+	Message.Bytes = MoveTemp(Bytes);
+	Message.TransferId = INDEX_NONE;
+	Message.EnqueueCycle = FPlatformTime::Cycles64();
+	TCPWRAPPER_TRACE_MESSAGE(MessageQueued, ConnectionId, (uint8)Lane, Message.Bytes.Num(), Message.EnqueueCycle);
+
+	QueuedBytes.Add(Message.Bytes.Num());
+	PendingMessages.Increment();
+	Outgoing[Lane].Queue.Enqueue(MoveTemp(Message));
+	return true;
+}
+
+void FTCPMessageLanes::EnqueueStream(FTCPStreamSourcePtr Source, ETCPMessagePriority Priority, int32 TransferId)
+{
+	const int32 Lane = LaneFor(Priority);
+
+	FOutgoingMessage Message;
+	Message.Stream = Source;
+	Message.TransferId = TransferId;
+	Message.EnqueueCycle = FPlatformTime::Cycles64();
+	TCPWRAPPER_TRACE_MESSAGE(MessageQueued, ConnectionId, (uint8)Lane, Source->GetSize(), Message.EnqueueCycle);
+
+	PendingMessages.Increment();
+	Outgoing[Lane].Queue.Enqueue(MoveTemp(Message));
+}
+
+int32 FTCPMessageLanes::LaneFor(ETCPMessagePriority Priority) const
+{
+	//raw bytes have no lane to tell the receiver about, everything goes out in the order it was queued
+	if (!bFramed)
+	{
+		return 0;
+	}
+	return FMath::Clamp((int32)Priority, 0, NumLanes - 1);
+}
+
+bool FTCPMessageLanes::HasPendingSends() const
+{
+	return PendingMessages.GetValue() > 0;
+}
+
+int32 FTCPMessageLanes::PickLane()
+{
+	//unframed messages all share one lane, so this also sends them in order without interleaving
+	if (Scheduling == ETCPLaneScheduling::Strict || !bFramed)
+	{
+		for (int32 Lane = 0; Lane < NumLanes; Lane++)
+		{
+			if (Outgoing[Lane].bHasCurrent || !Outgoing[Lane].Queue.IsEmpty())
+			{
+				return Lane;
+			}
+		}
+		return INDEX_NONE;
+	}
+
+	//smooth weighted round robin over the lanes that have something to send
+	int32 Picked = INDEX_NONE;
+	int32 TotalWeight = 0;
+	for (int32 Lane = 0; Lane < NumLanes; Lane++)
+	{
+		FOutgoingLane& Out = Outgoing[Lane];
+		if (!Out.bHasCurrent && Out.Queue.IsEmpty())
+		{
+			continue;
+		}
+		Out.CurrentWeight += Out.Weight;
+		TotalWeight += Out.Weight;
+		if (Picked == INDEX_NONE || Out.CurrentWeight > Outgoing[Picked].CurrentWeight)
+		{
+			Picked = Lane;
+		}
+	}
+	if (Picked != INDEX_NONE)
+	{
+		Outgoing[Picked].CurrentWeight -= TotalWeight;
+	}
+	return Picked;
+}
+
+bool FTCPMessageLanes::SendFrame(FTCPConnection& Connection, int32 Lane, int32& OutFrameBytes)
+{
+	OutFrameBytes = 0;
+	FOutgoingLane& Out = Outgoing[Lane];
+	if (!Out.bHasCurrent)
+	{
+		if (!Out.Queue.Dequeue(Out.Current))
+		{
+			return true;
+		}
+		Out.Offset = 0;
+		Out.LastProgress = 0;
+		Out.DequeueCycle = FPlatformTime::Cycles64();
+		Out.bHasCurrent = true;
+	}
+
+	FTCPStreamSource* Stream = Out.Current.Stream.Get();
+	const int64 MessageSize = Stream ? Stream->GetSize() : Out.Current.Bytes.Num();
+	const int32 PayloadSize = (int32)FMath::Min<int64>(FrameSize, MessageSize - Out.Offset);
+	const int32 HeaderSize = bFramed ? FrameHeaderSize : 0;
+
+	uint8 Flags = Stream ? Frame_Stream : 0;
+	if (Out.Offset == 0)
+	{
+		Flags |= Frame_Begin;
+	}
+	if (Out.Offset + PayloadSize == MessageSize)
+	{
+		Flags |= Frame_End;
+	}
+
+	int32 BytesSent = 0;
+	if (Stream && Stream->CanSendDirect(Connection))
+	{
+		//header from user space, payload goes file -> socket without being copied through us
+		if (HeaderSize > 0)
+		{
+			FrameBuffer.SetNumUninitialized(HeaderSize, false);
+			WriteHeader(FrameBuffer.GetData(), (uint8)Lane, Flags, (uint32)PayloadSize, (uint64)MessageSize);
+			if (!Connection.Send(FrameBuffer.GetData(), HeaderSize, BytesSent) || BytesSent != HeaderSize)
+			{
+				return false;
+			}
+		}
+		if (PayloadSize > 0 && !Stream->SendDirect(Connection, PayloadSize))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		//header and payload go out in one send so a frame never gets split by Nagle
+		FrameBuffer.SetNumUninitialized(HeaderSize + PayloadSize, false);
+		if (HeaderSize > 0)
+		{
+			WriteHeader(FrameBuffer.GetData(), (uint8)Lane, Flags, (uint32)PayloadSize, (uint64)MessageSize);
+		}
+		if (PayloadSize > 0)
+		{
+			if (Stream)
+			{
+				if (!Stream->Read(FrameBuffer.GetData() + HeaderSize, PayloadSize))
+				{
+					UE_LOG(LogTemp, Warning, TEXT("TCPMessageLanes: streamed file ended early, dropping connection"));
+					return false;
+				}
+			}
+			else
+			{
+				FMemory::Memcpy(FrameBuffer.GetData() + HeaderSize, Out.Current.Bytes.GetData() + Out.Offset, PayloadSize);
+			}
+		}
+		if (FrameBuffer.Num() > 0 && (!Connection.Send(FrameBuffer.GetData(), FrameBuffer.Num(), BytesSent) || BytesSent != FrameBuffer.Num()))
+		{
+			return false;
+		}
+	}
+
+	Out.Offset += PayloadSize;
+	OutFrameBytes = HeaderSize + PayloadSize;
+
+	if (Stream && OnSendProgress && ((Out.Offset - Out.LastProgress) >= ProgressStep(MessageSize) || (Flags & Frame_End)))
+	{
+		Out.LastProgress = Out.Offset;
+		OnSendProgress(Out.Current.TransferId, Out.Offset, MessageSize);
+	}
+
+	if (Flags & Frame_End)
+	{
+		TCPWRAPPER_TRACE_MESSAGE(MessageSent, ConnectionId, (uint8)Lane, MessageSize, Out.Current.EnqueueCycle, Out.DequeueCycle);
+		QueuedBytes.Subtract(Out.Current.Bytes.Num());
+		if (Budget.IsValid())
+		{
+			Budget->AddUserBytes(-Out.Current.Bytes.Num());
+		}
+		Out.Current = FOutgoingMessage();
+		Out.Offset = 0;
+		Out.bHasCurrent = false;
+		PendingMessages.Decrement();
+	}
+	return true;
+}
+
+bool FTCPMessageLanes::PumpSends(FTCPConnection& Connection, int32 MaxFrames, int64& OutBytesSent)
+{
+	TCPWRAPPER_TRACE_SCOPE(Send);
+
+	OutBytesSent = 0;
+	for (int32 Frame = 0; Frame < MaxFrames; Frame++)
+	{
+		//a peer that stops reading must not block the I/O thread, leave the rest for when there is room
+		if (!Connection.Wait(ESocketWaitConditions::WaitForWrite, FTimespan::Zero()))
+		{
+			break;
+		}
+
+		const int32 Lane = PickLane();
+		if (Lane == INDEX_NONE)
+		{
+			break;
+		}
+
+		int32 FrameBytes = 0;
+		if (!SendFrame(Connection, Lane, FrameBytes))
+		{
+			return false;
+		}
+		OutBytesSent += FrameBytes;
+	}
+	return true;
+}
+
+int64 FTCPMessageLanes::GetAllocatedSize() const
+{
+	int64 Size = FrameBuffer.GetAllocatedSize();
+	for (int32 Lane = 0; Lane < NumLanes; Lane++)
+	{
+		Size += Incoming[Lane].Message.GetAllocatedSize();
+	}
+	return Size;
+}
+
+void FTCPMessageLanes::Trim()
+{
+	FrameBuffer.Empty();
+	for (int32 Lane = 0; Lane < NumLanes; Lane++)
+	{
+		if (!Incoming[Lane].bInMessage)
+		{
+			Incoming[Lane].Message.Empty();
+		}
+	}
+}
+
+bool FTCPMessageLanes::BeginIncoming(FIncomingLane& In, uint64 MessageSize)
+{
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+
+	if (In.FileWriter.IsValid())
+	{
+		In.FileWriter.Reset();
+		PlatformFile.DeleteFile(*In.FilePath);
+	}
+
+	In.TransferId = ++ReceiveTransferCount;
+	In.Received = 0;
+	In.Total = (int64)MessageSize;
+	In.LastProgress = 0;
+	In.Message.Reset();
+	In.bInMessage = true;
+	In.bDiscard = false;
+
+	//streams can be any size so they only ever go to disk
+	if (PayloadFlags & Frame_Stream)
+	{
+		if (ReceiveDirectory.IsEmpty())
+		{
+			UE_LOG(LogTemp, Warning, TEXT("TCPMessageLanes: no ReceiveFileDirectory set, dropping streamed transfer of %llu bytes"), MessageSize);
+			In.bDiscard = true;
+			return true;
+		}
+
+		PlatformFile.CreateDirectoryTree(*ReceiveDirectory);
+		In.FilePath = FPaths::CreateTempFilename(*ReceiveDirectory, TEXT("TCPTransfer"), TEXT(".bin"));
+		In.FileWriter.Reset(PlatformFile.OpenWrite(*In.FilePath));
+		if (!In.FileWriter.IsValid())
+		{
+			UE_LOG(LogTemp, Warning, TEXT("TCPMessageLanes: unable to write %s, dropping streamed transfer"), *In.FilePath);
+			In.bDiscard = true;
+		}
+		return true;
+	}
+
+	if (MessageSize > (uint64)FMath::Clamp<int64>(MaxMessageSize, 0, MAX_int32))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("TCPMessageLanes: dropping %llu byte message, larger than the %lld byte limit"), MessageSize, MaxMessageSize);
+		In.bDiscard = true;
+		return true;
+	}
+
+	In.Message.Reserve((int32)FMath::Min(MessageSize, MaxInitialReserve));
+	return true;
+}
+
+bool FTCPMessageLanes::AppendIncoming(FIncomingLane& In, const uint8* Data, int32 Count)
+{
+	//the advertised size is what the limits were checked against, don't let frames sneak past it
+	if (In.Received + Count > In.Total)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("TCPMessageLanes: frames exceed the advertised message size of %lld bytes"), In.Total);
+		return false;
+	}
+	In.Received += Count;
+
+	if (In.bDiscard)
+	{
+		return true;
+	}
+
+	if (In.FileWriter.IsValid())
+	{
+		//a truncated file must not be announced as received, read and drop the rest instead
+		if (!In.FileWriter->Write(Data, Count))
+		{
+			UE_LOG(LogTemp, Warning, TEXT("TCPMessageLanes: writing %s failed, dropping streamed transfer"), *In.FilePath);
+			In.FileWriter.Reset();
+			FPlatformFileManager::Get().GetPlatformFile().DeleteFile(*In.FilePath);
+			In.bDiscard = true;
+			return true;
+		}
+	}
+	else
+	{
+		In.Message.Append(Data, Count);
+	}
+
+	if ((PayloadFlags & Frame_Stream) && OnReceiveProgress && (In.Received - In.LastProgress) >= ProgressStep(In.Total))
+	{
+		In.LastProgress = In.Received;
+		OnReceiveProgress(In.TransferId, In.Received, In.Total);
+	}
+	return true;
+}
+
+void FTCPMessageLanes::FinishIncoming(FIncomingLane& In, int32 Lane)
+{
+	In.bInMessage = false;
+
+	if (In.bDiscard)
+	{
+		In.bDiscard = false;
+		return;
+	}
+
+	if ((PayloadFlags & Frame_Stream) && OnReceiveProgress && In.LastProgress != In.Received)
+	{
+		OnReceiveProgress(In.TransferId, In.Received, In.Total);
+	}
+
+	if (In.FileWriter.IsValid())
+	{
+		In.FileWriter.Reset();
+		if (OnFileReceived)
+		{
+			OnFileReceived(In.FilePath);
+		}
+	}
+	else if (OnMessage)
+	{
+		OnMessage(In.Message, (ETCPMessagePriority)Lane);
+	}
+	In.Message.Reset();
+}
+
+bool FTCPMessageLanes::ReceiveBytes(const uint8* Data, int32 Count)
+{
+	TCPWRAPPER_TRACE_SCOPE(Framing);
+
+	while (Count > 0)
+	{
+		if (HeaderFilled < FrameHeaderSize)
+		{
+			const int32 Take = FMath::Min(FrameHeaderSize - HeaderFilled, Count);
+			FMemory::Memcpy(HeaderBytes + HeaderFilled, Data, Take);
+			HeaderFilled += Take;
+			Data += Take;
+			Count -= Take;
+
+			if (HeaderFilled < FrameHeaderSize)
+			{
+				break;
+			}
+
+			PayloadLane = HeaderBytes[0];
+			PayloadFlags = HeaderBytes[1];
+			const uint32 PayloadSize = ReadUInt32(HeaderBytes + 4);
+			const uint64 MessageSize = ReadUInt64(HeaderBytes + 8);
+
+			if (PayloadLane >= NumLanes || PayloadSize > (uint32)MaxFramePayload)
+			{
+				UE_LOG(LogTemp, Warning, TEXT("TCPMessageLanes: malformed frame header (lane %d, payload %u)"), PayloadLane, PayloadSize);
+				return false;
+			}
+
+			FIncomingLane& In = Incoming[PayloadLane];
+			if (PayloadFlags & Frame_Begin)
+			{
+				if (!BeginIncoming(In, MessageSize))
+				{
+					return false;
+				}
+			}
+			else if (!In.bInMessage)
+			{
+				UE_LOG(LogTemp, Warning, TEXT("TCPMessageLanes: continuation frame without a message on lane %d"), PayloadLane);
+				return false;
+			}
+			PayloadRemaining = (int32)PayloadSize;
+		}
+		else
+		{
+			const int32 Take = FMath::Min(PayloadRemaining, Count);
+			if (!AppendIncoming(Incoming[PayloadLane], Data, Take))
+			{
+				return false;
+			}
+			PayloadRemaining -= Take;
+			Data += Take;
+			Count -= Take;
+		}
+
+		//frame complete, hand out the message if this was its last frame
+		if (PayloadRemaining == 0)
+		{
+			HeaderFilled = 0;
+
+			if (PayloadFlags & Frame_End)
+			{
+				FinishIncoming(Incoming[PayloadLane], PayloadLane);
+			}
+		}
+	}
+	return true;
+}
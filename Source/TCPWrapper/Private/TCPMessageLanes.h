@@ -0,0 +1,165 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Containers/Queue.h"
+#include "GenericPlatform/GenericPlatformFile.h"
+#include "TCPConnection.h"
+#include "TCPStreamSource.h"
+#include "TCPServerComponent.h"
+
+class FTCPBufferBudget;
+
+/**
+* Outgoing queue + framing + priority scheduling for a single connection.
+*
+* Messages are split into frames of at most FrameSize bytes, each prefixed by a small header
+* naming its lane. The sender picks the next frame from the highest priority lane (strict) or
+* shares frames by weight, so a control message only waits for the bulk frames already handed to the
+* kernel, which the components keep to SendBufferFrames by capping the send buffer. The receiver
+* reassembles frames per lane and hands out whole messages, or writes streamed transfers to disk.
+*
+* When not framed the same queue still sends messages and file streams from the I/O thread,
+* just as raw bytes without headers and strictly in the order they were queued, ignoring priority.
+*
+* Enqueue may be called from any thread, sending and receiving must stay on the connection's I/O thread.
+*/
+class FTCPMessageLanes
+{
+public:
+	static const int32 NumLanes = 3;
+	static const int32 FrameHeaderSize = 16;
+
+	/** Upper bound on accepted frame payloads, anything larger is treated as a broken stream */
+	static const int32 MaxFramePayload = 16 * 1024 * 1024;
+
+	/** Frames the kernel send buffer should hold when framed, anything queued there can't be overtaken by a control frame */
+	static const int32 SendBufferFrames = 4;
+
+	enum EFrameFlags
+	{
+		Frame_Begin = 0x01,
+		Frame_End = 0x02,
+		Frame_Stream = 0x04,	//payload was streamed from a file, receiver may write it straight to disk
+	};
+
+	FTCPMessageLanes(bool bInFramed, int32 InFrameSize, ETCPLaneScheduling InScheduling, const TArray<int32>& InWeights);
+	~FTCPMessageLanes();
+
+	/** Called on the I/O thread for each reassembled in-memory message */
+	TFunction<void(TArray<uint8>&, ETCPMessagePriority)> OnMessage;
+
+	/** Called on the I/O thread once a streamed transfer has been fully written to ReceiveDirectory */
+	TFunction<void(const FString&)> OnFileReceived;
+
+	/** Transfer id, bytes done, total bytes. Throttled, always called on completion. */
+	TFunction<void(int32, int64, int64)> OnSendProgress;
+	TFunction<void(int32, int64, int64)> OnReceiveProgress;
+
+	/** If set, incoming streamed transfers are written to a new file in this folder instead of memory */
+	FString ReceiveDirectory;
+
+	/** Connection these lanes belong to, tags their trace events */
+	uint32 ConnectionId;
+
+	/** Largest message reassembled in memory, bigger ones are read and dropped */
+	int64 MaxMessageSize;
+
+	/** Queued message bytes are reserved here until sent, set before anything is queued */
+	TSharedPtr<FTCPBufferBudget, ESPMode::ThreadSafe> Budget;
+
+	bool IsFramed() const { return bFramed; }
+
+	/**
+	* Queue a message for sending. Thread safe.
+	* @return false if the message didn't fit in what's left of the memory budget, nothing is queued then
+	*/
+	bool Enqueue(TArray<uint8>&& Bytes, ETCPMessagePriority Priority);
+
+	/** Queue a streamed transfer, TransferId is passed back through OnSendProgress. Thread safe. */
+	void EnqueueStream(FTCPStreamSourcePtr Source, ETCPMessagePriority Priority, int32 TransferId);
+
+	/** True if any lane still has anything to send. Thread safe. */
+	bool HasPendingSends() const;
+
+	/**
+	* Send up to MaxFrames frames, interleaving lanes according to the scheduling mode.
+	* Stops early once the connection isn't writable so a slow reader doesn't stall the I/O thread.
+	* @param OutBytesSent	bytes handed to the connection, including headers
+	* @return false if the connection failed to send
+	*/
+	bool PumpSends(FTCPConnection& Connection, int32 MaxFrames, int64& OutBytesSent);
+
+	/**
+	* Feed raw stream bytes in, whole messages come out through OnMessage/OnFileReceived.
+	* @return false if the stream is malformed and the connection should be dropped
+	*/
+	bool ReceiveBytes(const uint8* Data, int32 Count);
+
+	/** User space bytes held by frame/reassembly buffers, queued messages are already reserved in Budget. I/O thread only. */
+	int64 GetAllocatedSize() const;
+
+	/** Release buffer capacity that isn't in use, call when the connection goes idle. I/O thread only. */
+	void Trim();
+
+private:
+	struct FOutgoingMessage
+	{
+		TArray<uint8> Bytes;
+		FTCPStreamSourcePtr Stream;
+		int32 TransferId;
+		uint64 EnqueueCycle;
+	};
+
+	struct FOutgoingLane
+	{
+		TQueue<FOutgoingMessage, EQueueMode::Mpsc> Queue;
+		FOutgoingMessage Current;
+		int64 Offset;
+		int64 LastProgress;
+		uint64 DequeueCycle;
+		bool bHasCurrent;
+		int32 Weight;
+		int32 CurrentWeight;
+	};
+
+	struct FIncomingLane
+	{
+		TArray<uint8> Message;
+		TUniquePtr<IFileHandle> FileWriter;
+		FString FilePath;
+		int32 TransferId;
+		int64 Received;
+		int64 Total;
+		int64 LastProgress;
+		bool bInMessage;
+		bool bDiscard;	//refused, read the rest of it without keeping anything
+	};
+
+	/** Lane a message of Priority is queued on, always the same one when unframed */
+	int32 LaneFor(ETCPMessagePriority Priority) const;
+
+	/** Returns the lane the next frame should come from or INDEX_NONE if nothing is queued */
+	int32 PickLane();
+	bool SendFrame(FTCPConnection& Connection, int32 Lane, int32& OutFrameBytes);
+	bool BeginIncoming(FIncomingLane& In, uint64 MessageSize);
+	bool AppendIncoming(FIncomingLane& In, const uint8* Data, int32 Count);
+	void FinishIncoming(FIncomingLane& In, int32 Lane);
+
+	bool bFramed;
+	int32 FrameSize;
+	ETCPLaneScheduling Scheduling;
+	FThreadSafeCounter PendingMessages;
+	FThreadSafeCounter64 QueuedBytes;
+
+	FOutgoingLane Outgoing[NumLanes];
+	FIncomingLane Incoming[NumLanes];
+	TArray<uint8> FrameBuffer;
+	int32 ReceiveTransferCount;
+
+	//receive state machine, a frame header may be split across reads
+	uint8 HeaderBytes[FrameHeaderSize];
+	int32 HeaderFilled;
+	int32 PayloadRemaining;
+	int32 PayloadLane;
+	uint8 PayloadFlags;
+};
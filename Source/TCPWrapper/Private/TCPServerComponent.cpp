@@ -3,211 +3,617 @@
 #include "Async/Async.h"
 #include "TCPWrapperUtility.h"
 #include "SocketSubsystem.h"
+#include "TCPUnixSocket.h"
+#include "TCPMessageLanes.h"
+#include "TCPStreamSource.h"
+#include "TCPBufferBudget.h"
+#include "TCPConnectionDrain.h"
+#include "TCPWrapperTrace.h"
 #include "Kismet/KismetSystemLibrary.h"
+#include "Containers/Ticker.h"
+#include "UObject/GarbageCollection.h"
 
+//frames sent per client each loop, keeps one busy client from starving the others
+static const int32 MaxLaneFramesPerPump = 8;
 
-UTCPServerComponent::UTCPServerComponent(const FObjectInitializer &init) : UActorComponent(init)
-{
-	bShouldAutoListen = true;
-	bReceiveDataOnGameThread = true;
-	bWantsInitializeComponent = true;
-	bAutoActivate = true;
-	ListenPort = 3000;
-	ListenSocketName = TEXT("ue4-tcp-server");
-	bDisconnectOnFailedEmit = true;
-	bShouldPing = false;
-	PingInterval = 10.0f;
-	PingMessage = TEXT("<Ping>");
+//extra time the server thread gets to close things itself before we shut its sockets down under it
+static const double ShutdownCloseGrace = 0.5;
 
-	BufferMaxSize = 2 * 1024 * 1024;	//default roughly 2mb
+/**
+* Everything the server thread touches. The thread holds a reference until it has drained, so the
+* component can be garbage collected as soon as it's unreachable and never waits on the thread.
+* Settings are copied when listening starts, events go back through Owner if it's still around.
+*/
+class FTCPServerSession
+{
+public:
+	explicit FTCPServerSession(UTCPServerComponent* Component);
+
+	/** Server thread body, returns once every client has drained after StopListenServer */
+	void Run();
+
+	/** Once ShutdownDeadline has passed close every connection the server thread may still be blocked on. Returns true while there's time left. */
+	bool CloseConnectionsPastDeadline();
+
+	TWeakObjectPtr<UTCPServerComponent> Owner;
+	FTCPClientRegistry Clients;
+	FSocket* ListenSocket;
+	TSharedPtr<FTCPUnixListener, ESPMode::ThreadSafe> UnixListenSocket;
+	TSharedPtr<FTCPBufferBudget, ESPMode::ThreadSafe> BufferBudget;
+	FThreadSafeBool bShouldListen;
+	FThreadSafeBool bFinished;
+	double ShutdownDeadline;
+
+private:
+	/** Run Event on the game thread if the component is still alive by then */
+	void PostToOwner(TFunction<void(UTCPServerComponent*)> Event);
+
+	/** Hand received bytes to OnReceivedBytes on the configured thread */
+	void BroadcastReceivedBytes(const TArray<uint8>& Bytes, uint32 ConnectionId);
+
+	/** Outgoing queue for a new connection, wired to the component's events */
+	TSharedPtr<FTCPMessageLanes, ESPMode::ThreadSafe> CreateLanes(uint32 ConnectionId);
+
+	/** Buffer sizing for a new connection, drawing from BufferBudget */
+	TSharedPtr<FTCPAdaptiveBuffer, ESPMode::ThreadSafe> CreateBuffers();
+
+	int32 UnixClientCount;
+
+	bool bUseSharedMemoryRing;
+	bool bReceiveDataOnGameThread;
+	bool bDisconnectOnFailedEmit;
+	bool bShouldPing;
+	float PingInterval;
+	TArray<uint8> PingData;
+	float ShutdownTimeout;
+
+	bool bUsePriorityLanes;
+	int32 LaneFrameSize;
+	ETCPLaneScheduling LaneScheduling;
+	TArray<int32> LaneWeights;
+	FString ReceiveFileDirectory;
+	int32 MaxReceiveMessageSize;
+
+	bool bAdaptiveBufferSizing;
+	int32 MinBufferSize;
+	int32 BufferMaxSize;
+	float BufferTargetLatency;
+};
+
+FTCPServerSession::FTCPServerSession(UTCPServerComponent* Component)
+	: Owner(Component)
+	, ListenSocket(nullptr)
+	, BufferBudget(Component->BufferBudget)
+	, ShutdownDeadline(MAX_dbl)
+	, UnixClientCount(0)
+	, bUseSharedMemoryRing(Component->bUseSharedMemoryRing)
+	, bReceiveDataOnGameThread(Component->bReceiveDataOnGameThread)
+	, bDisconnectOnFailedEmit(Component->bDisconnectOnFailedEmit)
+	, bShouldPing(Component->bShouldPing)
+	, PingInterval(Component->PingInterval)
+	, PingData(Component->PingData)
+	, ShutdownTimeout(Component->ShutdownTimeout)
+	, bUsePriorityLanes(Component->bUsePriorityLanes)
+	, LaneFrameSize(Component->LaneFrameSize)
+	, LaneScheduling(Component->LaneScheduling)
+	, LaneWeights(Component->LaneWeights)
+	, ReceiveFileDirectory(Component->ReceiveFileDirectory)
+	, MaxReceiveMessageSize(Component->MaxReceiveMessageSize)
+	, bAdaptiveBufferSizing(Component->bAdaptiveBufferSizing)
+	, MinBufferSize(Component->MinBufferSize)
+	, BufferMaxSize(Component->BufferMaxSize)
+	, BufferTargetLatency(Component->BufferTargetLatency)
+{
 }
 
-void UTCPServerComponent::StartListenServer(const int32 InListenPort)
+void FTCPServerSession::Run()
 {
-	FIPv4Address Address;
-	FIPv4Address::Parse(TEXT("0.0.0.0"), Address);
-
-	//Create Socket
-	FIPv4Endpoint Endpoint(Address, InListenPort);
+	uint32 BufferSize = 0;
+	TArray<uint8> ReceiveBuffer;
+	TArray<FTCPClientPtr> ClientsDisconnected;
 
-	ListenSocket = FTcpSocketBuilder(*ListenSocketName)
-		//.AsNonBlocking()
-		.AsReusable()
-		.BoundToEndpoint(Endpoint)
-		.WithReceiveBufferSize(BufferMaxSize);
+	FDateTime LastPing = FDateTime::Now();
 
-	ListenSocket->SetReceiveBufferSize(BufferMaxSize, BufferMaxSize);
-	ListenSocket->SetSendBufferSize(BufferMaxSize, BufferMaxSize);
+	//the receive buffer is shared by all clients, let it go once nobody has sent anything for a while
+	double LastReceiveTime = FPlatformTime::Seconds();
+	int64 ReceiveBufferReported = 0;
 
-	ListenSocket->Listen(8);
-
-	OnListenBegin.Broadcast();
-	bShouldListen = true;
-
-	//Start a lambda thread to handle data
-	ServerFinishedFuture = FTCPWrapperUtility::RunLambdaOnBackGroundThread([&]()
+	while (bShouldListen)
 	{
-		uint32 BufferSize = 0;
-		TArray<uint8> ReceiveBuffer;
-		TArray<TSharedPtr<FTCPClient>> ClientsDisconnected;
+		bool bHasPendingSends = false;
+		const double Now = FPlatformTime::Seconds();
 
-		FDateTime LastPing = FDateTime::Now();
+		//Do we have clients trying to connect? connect them
+		bool bHasPendingConnection = false;
+		FTCPConnectionPtr NewConnection;
+		FString AddressString;
 
-		while (bShouldListen)
+#if TCPWRAPPER_WITH_UNIX_SOCKETS
+		if (UnixListenSocket.IsValid())
+		{
+			UnixListenSocket->HasPendingConnection(bHasPendingConnection);
+			if (bHasPendingConnection)
+			{
+				TCPWRAPPER_TRACE_SCOPE(Accept);
+
+				//unix peers have no address, give each one a unique name on the socket path instead
+				NewConnection = UnixListenSocket->Accept();
+				if (bUseSharedMemoryRing && NewConnection.IsValid())
+				{
+					NewConnection = FTCPConnection::AcceptSharedMemoryRing(NewConnection);
+				}
+				AddressString = FString::Printf(TEXT("unix:%s#%d"), *UnixListenSocket->GetPath(), ++UnixClientCount);
+			}
+		}
+		else
+#endif
 		{
-			//Do we have clients trying to connect? connect them
-			bool bHasPendingConnection;
 			ListenSocket->HasPendingConnection(bHasPendingConnection);
 			if (bHasPendingConnection)
 			{
+				TCPWRAPPER_TRACE_SCOPE(Accept);
 				TSharedPtr<FInternetAddr> Addr = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr();
-				FSocket* Client = ListenSocket->Accept(*Addr,TEXT("tcp-client"));
+				NewConnection = FTCPConnection::FromSocket(ListenSocket->Accept(*Addr, TEXT("tcp-client")));
+				AddressString = Addr->ToString(true);
+			}
+		}
 
-				const FString AddressString = Addr->ToString(true);
+		if (NewConnection.IsValid())
+		{
+			FTCPClientPtr ClientItem = MakeShareable(new FTCPClient());
+			ClientItem->Address = AddressString;
+			ClientItem->Connection = NewConnection;
+			ClientItem->Lanes = CreateLanes(NewConnection->GetId());
+			ClientItem->Buffers = CreateBuffers();
+			ClientItem->Buffers->Initialize(*NewConnection);
 
-				TSharedPtr<FTCPClient> ClientItem = MakeShareable(new FTCPClient());
-				ClientItem->Address = AddressString;
-				ClientItem->Socket = Client;
+			Clients.Add(AddressString, ClientItem);
 
-				Clients.Add(AddressString, ClientItem);	//todo: balance this with remove when clients disconnect
+			PostToOwner([AddressString](UTCPServerComponent* Component)
+			{
+				Component->OnClientConnected.Broadcast(AddressString);
+			});
+		}
 
-				AsyncTask(ENamedThreads::GameThread, [&, AddressString]()
-				{
-					OnClientConnected.Broadcast(AddressString);
-				});
+		//Check each endpoint for data, working off a snapshot so game thread emits never wait on us
+		FTCPClientSnapshot ClientsSnapshot = Clients.Snapshot();
+		for (const auto& ClientPair : *ClientsSnapshot)
+		{
+			const FTCPClientPtr& Client = ClientPair.Value;
+
+			//Did we disconnect? Note that this almost never changed from connected due to engine bug, instead it will be caught when trying to send data
+
+			ESocketConnectionState ConnectionState = ESocketConnectionState::SCS_NotConnected;
+
+			if (Client->Connection.IsValid()) {
+				ConnectionState = Client->Connection->GetConnectionState();
 			}
 
-			//Check each endpoint for data
-			for (auto ClientPair : Clients)
+			if (ConnectionState != ESocketConnectionState::SCS_Connected)
 			{
-				TSharedPtr<FTCPClient> Client = ClientPair.Value;
+				ClientsDisconnected.Add(Client);
+				continue;
+			}
 
-				//Did we disconnect? Note that this almost never changed from connected due to engine bug, instead it will be caught when trying to send data
-				
-				ESocketConnectionState ConnectionState = ESocketConnectionState::SCS_NotConnected;
+			if (Client->Connection->HasPendingData(BufferSize))
+			{
+				TCPWRAPPER_TRACE_SCOPE(Recv);
 
-				if (Client->Socket != nullptr) {
-					ConnectionState = Client->Socket->GetConnectionState();
-				}
+				//don't grow past what the kernel buffer holds, the rest is picked up next loop
+				ReceiveBuffer.SetNumUninitialized(FMath::Min(BufferSize, (uint32)Client->Buffers->GetReceiveChunkSize()), false);
+				int32 Read = 0;
 
-				if (ConnectionState != ESocketConnectionState::SCS_Connected)
+				Client->Connection->Recv(ReceiveBuffer.GetData(), ReceiveBuffer.Num(), Read);
+				Client->Buffers->AddReceived(Read);
+				LastReceiveTime = Now;
+
+				if (Client->Lanes->IsFramed())
 				{
-					ClientsDisconnected.Add(Client);
-					continue;
+					//framed stream, only whole messages get broadcast
+					if (!Client->Lanes->ReceiveBytes(ReceiveBuffer.GetData(), Read))
+					{
+						Client->Connection->Close();
+						ClientsDisconnected.Add(Client);
+						continue;
+					}
 				}
-
-				if (Client->Socket->HasPendingData(BufferSize))
+				else
 				{
-					ReceiveBuffer.SetNumUninitialized(BufferSize);
-					int32 Read = 0;
-
-					Client->Socket->Recv(ReceiveBuffer.GetData(), ReceiveBuffer.Num(), Read);
+					ReceiveBuffer.SetNum(Read, false);
+					BroadcastReceivedBytes(ReceiveBuffer, Client->Connection->GetId());
+				}
+			}
 
-					if (bReceiveDataOnGameThread)
-					{
-						//Copy buffer so it's still valid on game thread
-						TArray<uint8> ReceiveBufferGT;
-						ReceiveBufferGT.Append(ReceiveBuffer);
+			//Flush queued lane frames and file streams
+			if (Client->Lanes->HasPendingSends())
+			{
+				FScopeLock SendScope(&Client->SendLock);
+				int64 BytesSent = 0;
+				const bool bPumped = Client->Lanes->PumpSends(*Client->Connection, MaxLaneFramesPerPump, BytesSent);
+				Client->Buffers->AddSent(BytesSent);
 
-						//Pass the reference to be used on gamethread
-						AsyncTask(ENamedThreads::GameThread, [&, ReceiveBufferGT]()
-						{
-							OnReceivedBytes.Broadcast(ReceiveBufferGT);
-						});
-					}
-					else
+				if (!bPumped)
+				{
+					//a partially sent frame can't be recovered from
+					if (bDisconnectOnFailedEmit || Client->Lanes->IsFramed())
 					{
-						OnReceivedBytes.Broadcast(ReceiveBuffer);
+						Client->Connection->Close();
 					}
 				}
+				else if (BytesSent > 0)
+				{
+					//only skip the sleep while we're making progress, a full socket waits like everything else
+					bHasPendingSends = bHasPendingSends || Client->Lanes->HasPendingSends();
+				}
+			}
 
-				//ping check
+			//Resize socket buffers to recent throughput, trim our own once idle
+			if (Client->Buffers->Update(*Client->Connection, Now, Client->Lanes->GetAllocatedSize()))
+			{
+				Client->Lanes->Trim();
+			}
 
-				if (bShouldPing)
-				{
-					FDateTime Now = FDateTime::Now();
-					float TimeSinceLastPing = (Now - LastPing).GetTotalSeconds();
+			//ping check
 
-					if (TimeSinceLastPing > PingInterval)
+			if (bShouldPing)
+			{
+				FDateTime PingNow = FDateTime::Now();
+				float TimeSinceLastPing = (PingNow - LastPing).GetTotalSeconds();
+
+				if (TimeSinceLastPing > PingInterval)
+				{
+					LastPing = PingNow;
+					FScopeLock SendScope(&Client->SendLock);
+					if (Client->Lanes->IsFramed() || Client->Lanes->HasPendingSends())
 					{
-						LastPing = Now;
+						//raw bytes would corrupt a framed stream or in-flight transfer, queue the ping instead
+						TArray<uint8> Ping = PingData;
+						Client->Lanes->Enqueue(MoveTemp(Ping), ETCPMessagePriority::Control);
+					}
+					else
+					{
+						TCPWRAPPER_TRACE_SCOPE(Send);
 						int32 BytesSent = 0;
-						bool Sent = Client->Socket->Send(PingData.GetData(), PingData.Num(), BytesSent);
+						bool Sent = Client->Connection->Send(PingData.GetData(), PingData.Num(), BytesSent);
 						//UE_LOG(LogTemp, Log, TEXT("ping."));
 						if (!Sent)
 						{
 							//UE_LOG(LogTemp, Log, TEXT("did not send."));
-							Client->Socket->Close();
+							Client->Connection->Close();
 						}
 					}
 				}
 			}
+		}
 
-			//Handle disconnections
-			if (ClientsDisconnected.Num() > 0)
+		if (Now - LastReceiveTime > 2.0 && ReceiveBuffer.Max() > 0)
+		{
+			ReceiveBuffer.Empty();
+		}
+		if (ReceiveBuffer.GetAllocatedSize() != ReceiveBufferReported)
+		{
+			BufferBudget->AddUserBytes(ReceiveBuffer.GetAllocatedSize() - ReceiveBufferReported);
+			ReceiveBufferReported = ReceiveBuffer.GetAllocatedSize();
+		}
+
+		//Handle disconnections
+		if (ClientsDisconnected.Num() > 0)
+		{
+			for (const FTCPClientPtr& ClientToRemove : ClientsDisconnected)
 			{
-				for (TSharedPtr<FTCPClient> ClientToRemove : ClientsDisconnected)
+				//DisconnectClient may have removed and announced it already
+				const FString Address = ClientToRemove->Address;
+				if (!Clients.Remove(Address).IsValid())
 				{
-					const FString Address = ClientToRemove->Address;
-					Clients.Remove(Address);
-					AsyncTask(ENamedThreads::GameThread, [this, Address]()
-					{
-						OnClientDisconnected.Broadcast(Address);
-					});
+					continue;
 				}
-				ClientsDisconnected.Empty();
+				PostToOwner([Address](UTCPServerComponent* Component)
+				{
+					Component->OnClientDisconnected.Broadcast(Address);
+				});
 			}
+			ClientsDisconnected.Empty();
+		}
 
-			//sleep for 100microns
+		//sleep for 100microns, unless frames are still waiting to go out
+		if (!bHasPendingSends)
+		{
 			FPlatformProcess::Sleep(0.0001);
-		}//end while
-	});
-}
+		}
+	}//end while
 
-void UTCPServerComponent::StopListenServer()
-{
+	BufferBudget->AddUserBytes(-ReceiveBufferReported);
+
+	//Stop accepting first so nobody connects just to be dropped
+	const double DrainDeadline = FPlatformTime::Seconds() + ShutdownTimeout;
 	if (ListenSocket)
 	{
-		bShouldListen = false;
-		ServerFinishedFuture.Get();
-
 		ListenSocket->Close();
 		ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(ListenSocket);
 		ListenSocket = nullptr;
+	}
+	UnixListenSocket.Reset();
+
+	//Then let every client finish receiving what was already queued for it. They stay registered
+	//until drained so CloseConnectionsPastDeadline can still reach a send that's stuck on one of them.
+	TArray<FTCPConnectionDrain> Drains;
+	FTCPClientSnapshot Draining = Clients.Snapshot();
+	for (const auto& ClientPair : *Draining)
+	{
+		Drains.Emplace(ClientPair.Value->Connection, ClientPair.Value->Lanes);
+	}
+	FTCPConnectionDrain::DrainAll(Drains, DrainDeadline);
+	Clients.Empty();
+	bFinished = true;
+
+	PostToOwner([](UTCPServerComponent* Component)
+	{
+		Component->bIsShuttingDown = false;
+		Component->OnShutdownComplete.Broadcast();
+	});
+}
+
+bool FTCPServerSession::CloseConnectionsPastDeadline()
+{
+	if (bFinished)
+	{
+		return false;
+	}
+	if (FPlatformTime::Seconds() < ShutdownDeadline)
+	{
+		return true;
+	}
+
+	//shutting the socket down makes a blocked send/sendfile return, the server thread then finishes up
+	UE_LOG(LogTemp, Warning, TEXT("TCPServerComponent: server thread is still draining past ShutdownTimeout, closing its connections."));
+	for (const auto& ClientPair : *Clients.Snapshot())
+	{
+		ClientPair.Value->Connection->Close();
+	}
+	return false;
+}
+
+void FTCPServerSession::PostToOwner(TFunction<void(UTCPServerComponent*)> Event)
+{
+	TWeakObjectPtr<UTCPServerComponent> WeakOwner = Owner;
+	AsyncTask(ENamedThreads::GameThread, [WeakOwner, Event]()
+	{
+		if (WeakOwner.IsValid())
+		{
+			Event(WeakOwner.Get());
+		}
+	});
+}
+
+void FTCPServerSession::BroadcastReceivedBytes(const TArray<uint8>& Bytes, uint32 ConnectionId)
+{
+	const uint64 ReceiveCycle = FPlatformTime::Cycles64();
+	TCPWRAPPER_TRACE_MESSAGE(MessageReceived, ConnectionId, Bytes.Num(), ReceiveCycle);
+
+	if (bReceiveDataOnGameThread)
+	{
+		//Copy buffer so it's still valid on game thread
+		TArray<uint8> ReceiveBufferGT;
+		ReceiveBufferGT.Append(Bytes);
+
+		//Pass the reference to be used on gamethread
+		PostToOwner([ReceiveBufferGT, ConnectionId, ReceiveCycle](UTCPServerComponent* Component)
+		{
+			TCPWRAPPER_TRACE_SCOPE(Dispatch);
+			TCPWRAPPER_TRACE_MESSAGE(MessageDispatched, ConnectionId, ReceiveBufferGT.Num(), ReceiveCycle);
+			Component->OnReceivedBytes.Broadcast(ReceiveBufferGT);
+		});
+	}
+	else
+	{
+		//garbage collection waits for the guard, so the component can't go away mid broadcast
+		FGCScopeGuard GCGuard;
+		if (UTCPServerComponent* Component = Owner.Get())
+		{
+			TCPWRAPPER_TRACE_SCOPE(Dispatch);
+			TCPWRAPPER_TRACE_MESSAGE(MessageDispatched, ConnectionId, Bytes.Num(), ReceiveCycle);
+			Component->OnReceivedBytes.Broadcast(Bytes);
+		}
+	}
+}
+
+TSharedPtr<FTCPMessageLanes, ESPMode::ThreadSafe> FTCPServerSession::CreateLanes(uint32 ConnectionId)
+{
+	TSharedPtr<FTCPMessageLanes, ESPMode::ThreadSafe> Lanes = MakeShareable(new FTCPMessageLanes(bUsePriorityLanes, LaneFrameSize, LaneScheduling, LaneWeights));
+	Lanes->ReceiveDirectory = ReceiveFileDirectory;
+	Lanes->ConnectionId = ConnectionId;
+	Lanes->MaxMessageSize = MaxReceiveMessageSize;
+	Lanes->Budget = BufferBudget;
+
+	//callbacks run on the server thread, which keeps us alive, the component might not be by then
+	Lanes->OnMessage = [this, ConnectionId](TArray<uint8>& Message, ETCPMessagePriority Priority)
+	{
+		BroadcastReceivedBytes(Message, ConnectionId);
+	};
+	Lanes->OnFileReceived = [this](const FString& Path)
+	{
+		PostToOwner([Path](UTCPServerComponent* Component)
+		{
+			Component->OnReceivedFile.Broadcast(Path);
+		});
+	};
+	Lanes->OnSendProgress = [this](int32 TransferId, int64 Bytes, int64 Total)
+	{
+		PostToOwner([TransferId, Bytes, Total](UTCPServerComponent* Component)
+		{
+			Component->OnSendProgress.Broadcast(TransferId, Bytes, Total);
+		});
+	};
+	Lanes->OnReceiveProgress = [this](int32 TransferId, int64 Bytes, int64 Total)
+	{
+		PostToOwner([TransferId, Bytes, Total](UTCPServerComponent* Component)
+		{
+			Component->OnReceiveProgress.Broadcast(TransferId, Bytes, Total);
+		});
+	};
+	return Lanes;
+}
+
+TSharedPtr<FTCPAdaptiveBuffer, ESPMode::ThreadSafe> FTCPServerSession::CreateBuffers()
+{
+	//fixed sizing is just adaptive sizing with nowhere to move
+	const int32 MinSize = bAdaptiveBufferSizing ? MinBufferSize : BufferMaxSize;
+	TSharedPtr<FTCPAdaptiveBuffer, ESPMode::ThreadSafe> NewBuffers = MakeShareable(new FTCPAdaptiveBuffer(BufferBudget, MinSize, BufferMaxSize, BufferTargetLatency));
+
+	if (bUsePriorityLanes)
+	{
+		//whatever sits in the kernel send buffer goes out ahead of any control frame, keep it to a few frames
+		NewBuffers->SetSendLimit(FTCPMessageLanes::SendBufferFrames * (LaneFrameSize + FTCPMessageLanes::FrameHeaderSize));
+	}
+	return NewBuffers;
+}
+
+UTCPServerComponent::UTCPServerComponent(const FObjectInitializer &init) : UActorComponent(init)
+{
+	bShouldAutoListen = true;
+	bReceiveDataOnGameThread = true;
+	bWantsInitializeComponent = true;
+	bAutoActivate = true;
+	ListenPort = 3000;
+	ListenSocketName = TEXT("ue4-tcp-server");
+	bUseUnixDomainSocket = false;
+	UnixSocketPath = TEXT("/tmp/ue4-tcp.sock");
+	bUseSharedMemoryRing = false;
+	bDisconnectOnFailedEmit = true;
+	bShouldPing = false;
+	bUsePriorityLanes = false;
+	LaneFrameSize = 16 * 1024;
+	LaneScheduling = ETCPLaneScheduling::Strict;
+	LaneWeights = { 8, 4, 1 };
+	MaxReceiveMessageSize = 64 * 1024 * 1024;
+	PingInterval = 10.0f;
+	PingMessage = TEXT("<Ping>");
+
+	BufferMaxSize = 2 * 1024 * 1024;	//default roughly 2mb
+	bAdaptiveBufferSizing = true;
+	MinBufferSize = 64 * 1024;
+	BufferTargetLatency = 0.1f;
+	MemoryBudgetMB = 256;
+	ShutdownTimeout = 2.f;
+	BufferBudget = MakeShareable(new FTCPBufferBudget(0));
+}
 
-		for (auto ClientPair : Clients)
+void UTCPServerComponent::StartListenServer(const int32 InListenPort)
+{
+	if (bIsShuttingDown)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("TCPServerComponent: previous server is still shutting down, listen again after OnShutdownComplete."));
+		return;
+	}
+
+	BufferBudget->SetBudget((int64)MemoryBudgetMB * 1024 * 1024);
+	TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> NewSession = MakeShareable(new FTCPServerSession(this));
+
+	if (bUseUnixDomainSocket)
+	{
+#if TCPWRAPPER_WITH_UNIX_SOCKETS
+		NewSession->UnixListenSocket = FTCPUnixListener::Listen(UnixSocketPath, 8);
+#endif
+		if (!NewSession->UnixListenSocket.IsValid())
 		{
-			ClientPair.Value->Socket->Close();
+			UE_LOG(LogTemp, Error, TEXT("TCPServerComponent: unable to listen on unix socket %s"), *UnixSocketPath);
+			return;
 		}
-		Clients.Empty();
-		
+	}
+	else
+	{
+		FIPv4Address Address;
+		FIPv4Address::Parse(TEXT("0.0.0.0"), Address);
+
+		//Create Socket
+		FIPv4Endpoint Endpoint(Address, InListenPort);
+
+		//accepted sockets inherit these, each connection then sizes its own
+		int32 InitialBufferSize = bAdaptiveBufferSizing ? MinBufferSize : BufferMaxSize;
+
+		FSocket* ListenSocket = FTcpSocketBuilder(*ListenSocketName)
+			//.AsNonBlocking()
+			.AsReusable()
+			.BoundToEndpoint(Endpoint)
+			.WithReceiveBufferSize(InitialBufferSize);
+
+		ListenSocket->SetReceiveBufferSize(InitialBufferSize, InitialBufferSize);
+		ListenSocket->SetSendBufferSize(InitialBufferSize, InitialBufferSize);
+
+		ListenSocket->Listen(8);
+		NewSession->ListenSocket = ListenSocket;
+	}
+
+	OnListenBegin.Broadcast();
+	NewSession->bShouldListen = true;
+	{
+		FScopeLock SessionScope(&SessionLock);
+		Session = NewSession;
+	}
+
+	//Start a lambda thread to handle data, it owns the session from here on
+	FTCPWrapperUtility::RunLambdaOnBackGroundThread([NewSession]()
+	{
+		NewSession->Run();
+	});
+}
+
+void UTCPServerComponent::StopListenServer()
+{
+	//draining clients aren't ours anymore, nothing new gets queued for them
+	TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> StoppedSession;
+	{
+		FScopeLock SessionScope(&SessionLock);
+		StoppedSession = Session;
+		Session.Reset();
+	}
+
+	if (StoppedSession.IsValid())
+	{
+		//the server thread flushes and closes everything, we don't wait for it
+		bIsShuttingDown = true;
+		StoppedSession->bShouldListen = false;
+
+		//a blocking send to a peer that stopped reading would outlast the thread's own deadline, close under it if so.
+		//The ticker only holds the session, so this still happens after we've been destroyed.
+		StoppedSession->ShutdownDeadline = FPlatformTime::Seconds() + ShutdownTimeout + ShutdownCloseGrace;
+		FTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateLambda([StoppedSession](float DeltaTime)
+		{
+			return StoppedSession->CloseConnectionsPastDeadline();
+		}));
+
 		OnListenEnd.Broadcast();
 	}
 }
 
-bool  UTCPServerComponent::Emit(const TArray<uint8>& Bytes, const FString& ToClient)
+TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> UTCPServerComponent::GetSession() const
+{
+	FScopeLock SessionScope(&SessionLock);
+	return Session;
+}
+
+bool UTCPServerComponent::Emit(const TArray<uint8>& Bytes, const FString& ToClient, ETCPMessagePriority Priority)
 {
-	if (Clients.Num()>0)
+	TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> CurrentSession = GetSession();
+	if (!CurrentSession.IsValid())
+	{
+		return false;
+	}
+
+	FTCPClientSnapshot ClientsSnapshot = CurrentSession->Clients.Snapshot();
+	if (ClientsSnapshot->Num()>0)
 	{
-		int32 BytesSent = 0;
 		//simple multi-cast
 		if (ToClient == TEXT("All"))
 		{
 			//Success is all of the messages emitted successfully
 			bool Success = true;
-			TArray<TSharedPtr<FTCPClient>> AllClients;
 
-			Clients.GenerateValueArray(AllClients);
-			for (TSharedPtr<FTCPClient>& Client : AllClients)
+			for (const auto& ClientPair : *ClientsSnapshot)
 			{
-				if (Client.IsValid())
+				if (ClientPair.Value.IsValid())
 				{
-					bool Sent = Client->Socket->Send(Bytes.GetData(), Bytes.Num(), BytesSent);
-					if (!Sent && bDisconnectOnFailedEmit)
-					{
-						Client->Socket->Close();
-					}
-					Success = Sent && Success;
+					Success = EmitToClient(ClientPair.Value, Bytes, Priority) && Success;
 				}
 			}
 			return Success;
@@ -215,47 +621,145 @@ bool  UTCPServerComponent::Emit(const TArray<uint8>& Bytes, const FString& ToCli
 		//match client address and port
 		else
 		{
-			TSharedPtr<FTCPClient> Client = Clients[ToClient];
+			const FTCPClientPtr* Client = ClientsSnapshot->Find(ToClient);
 
-			if (Client.IsValid())
+			if (Client && Client->IsValid())
 			{
-				bool Sent = Client->Socket->Send(Bytes.GetData(), Bytes.Num(), BytesSent);
-				if (!Sent && bDisconnectOnFailedEmit)
-				{
-					Client->Socket->Close();
-				}
-				return Sent;
+				return EmitToClient(*Client, Bytes, Priority);
 			}
 		}
 	}
 	return false;
 }
 
+bool UTCPServerComponent::EmitToClient(const FTCPClientPtr& Client, const TArray<uint8>& Bytes, ETCPMessagePriority Priority)
+{
+	//the check and the send go together, otherwise a message queued meanwhile could start going out under us
+	FScopeLock SendScope(&Client->SendLock);
+	if (Client->Lanes->IsFramed() || Client->Lanes->HasPendingSends())
+	{
+		//frames are sent from the server thread, failures show up there as a disconnect
+		TArray<uint8> Message = Bytes;
+		return Client->Lanes->Enqueue(MoveTemp(Message), Priority);
+	}
+
+	TCPWRAPPER_TRACE_SCOPE(Send);
+	const uint64 SendCycle = FPlatformTime::Cycles64();
+	int32 BytesSent = 0;
+	bool Sent = Client->Connection->Send(Bytes.GetData(), Bytes.Num(), BytesSent);
+	Client->Buffers->AddSent(BytesSent);
+	if (Sent)
+	{
+		TCPWRAPPER_TRACE_MESSAGE(MessageSent, Client->Connection->GetId(), (uint8)Priority, Bytes.Num(), SendCycle, SendCycle);
+	}
+	if (!Sent && bDisconnectOnFailedEmit)
+	{
+		Client->Connection->Close();
+	}
+	return Sent;
+}
+
+int32 UTCPServerComponent::EmitFile(const FString& FilePath, const FString& ToClient, ETCPMessagePriority Priority)
+{
+	TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> CurrentSession = GetSession();
+	if (!CurrentSession.IsValid())
+	{
+		return INDEX_NONE;
+	}
+
+	TArray<FTCPClientPtr> Targets;
+	if (ToClient == TEXT("All"))
+	{
+		CurrentSession->Clients.Snapshot()->GenerateValueArray(Targets);
+	}
+	else if (FTCPClientPtr Client = CurrentSession->Clients.Find(ToClient))
+	{
+		Targets.Add(Client);
+	}
+
+	if (Targets.Num() == 0)
+	{
+		return INDEX_NONE;
+	}
+
+	//each client reads at its own pace so needs its own reader, open them all before queueing any
+	TArray<FTCPStreamSourcePtr> Sources;
+	for (int32 Index = 0; Index < Targets.Num(); Index++)
+	{
+		FTCPStreamSourcePtr Source = FTCPStreamSource::OpenFile(FilePath);
+		if (!Source.IsValid())
+		{
+			return INDEX_NONE;
+		}
+		Sources.Add(Source);
+	}
+
+	const int32 TransferId = TransferCount.Increment();
+	for (int32 Index = 0; Index < Targets.Num(); Index++)
+	{
+		Targets[Index]->Lanes->EnqueueStream(Sources[Index], Priority, TransferId);
+	}
+	return TransferId;
+}
+
+int32 UTCPServerComponent::EmitStream(TUniquePtr<IFileHandle> Handle, const FString& ToClient, ETCPMessagePriority Priority)
+{
+	TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> CurrentSession = GetSession();
+	FTCPClientPtr Client = CurrentSession.IsValid() ? CurrentSession->Clients.Find(ToClient) : nullptr;
+	FTCPStreamSourcePtr Source = FTCPStreamSource::FromHandle(MoveTemp(Handle));
+
+	if (!Client.IsValid() || !Source.IsValid())
+	{
+		return INDEX_NONE;
+	}
+
+	const int32 TransferId = TransferCount.Increment();
+	Client->Lanes->EnqueueStream(Source, Priority, TransferId);
+	return TransferId;
+}
+
+FTCPMemoryStats UTCPServerComponent::GetMemoryStats()
+{
+	TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> CurrentSession = GetSession();
+
+	FTCPMemoryStats Stats;
+	Stats.Connections = CurrentSession.IsValid() ? CurrentSession->Clients.Num() : 0;
+	Stats.KernelBufferBytes = BufferBudget->GetKernelBytes();
+	Stats.UserBufferBytes = BufferBudget->GetUserBytes();
+	Stats.MemoryBudget = BufferBudget->GetBudget();
+	return Stats;
+}
+
 void UTCPServerComponent::DisconnectClient(FString ClientAddress /*= TEXT("All")*/, bool bDisconnectNextTick/*=false*/)
 {
 	TFunction<void()> DisconnectFunction = [this, ClientAddress]
 	{
+		TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> CurrentSession = GetSession();
+		if (!CurrentSession.IsValid())
+		{
+			return;
+		}
+
 		bool bDisconnectAll = ClientAddress == TEXT("All");
 
 		if (!bDisconnectAll)
 		{
-			TSharedPtr<FTCPClient> Client = Clients[ClientAddress];
+			FTCPClientPtr Client = CurrentSession->Clients.Remove(ClientAddress);
 
 			if (Client.IsValid())
 			{
-				Client->Socket->Close();
-				Clients.Remove(Client->Address);
-				OnClientDisconnected.Broadcast(ClientAddress);
+				Client->Connection->Close();
+				BroadcastClientDisconnected(ClientAddress);
 			}
 		}
 		else
 		{
-			for (auto ClientPair : Clients)
+			//keep the old map alive while we walk it, a temporary would be gone before the loop body runs
+			FTCPClientSnapshot Removed = CurrentSession->Clients.Empty();
+			for (const auto& ClientPair : *Removed)
 			{
-				TSharedPtr<FTCPClient> Client = ClientPair.Value;
-				Client->Socket->Close();
-				Clients.Remove(Client->Address);
-				OnClientDisconnected.Broadcast(ClientAddress);
+				ClientPair.Value->Connection->Close();
+				BroadcastClientDisconnected(ClientPair.Key);
 			}
 		}
 	};
@@ -263,7 +767,14 @@ void UTCPServerComponent::DisconnectClient(FString ClientAddress /*= TEXT("All")
 	if (bDisconnectNextTick)
 	{
 		//disconnect on next tick
-		AsyncTask(ENamedThreads::GameThread, DisconnectFunction);
+		TWeakObjectPtr<UTCPServerComponent> WeakThis(this);
+		AsyncTask(ENamedThreads::GameThread, [WeakThis, DisconnectFunction]()
+		{
+			if (WeakThis.IsValid())
+			{
+				DisconnectFunction();
+			}
+		});
 	}
 	else
 	{
@@ -271,6 +782,24 @@ void UTCPServerComponent::DisconnectClient(FString ClientAddress /*= TEXT("All")
 	}
 }
 
+void UTCPServerComponent::BroadcastClientDisconnected(const FString& Address)
+{
+	if (IsInGameThread())
+	{
+		OnClientDisconnected.Broadcast(Address);
+		return;
+	}
+
+	TWeakObjectPtr<UTCPServerComponent> WeakThis(this);
+	AsyncTask(ENamedThreads::GameThread, [WeakThis, Address]()
+	{
+		if (WeakThis.IsValid())
+		{
+			WeakThis->OnClientDisconnected.Broadcast(Address);
+		}
+	});
+}
+
 void UTCPServerComponent::InitializeComponent()
 {
 	Super::InitializeComponent();
@@ -298,4 +827,4 @@ void UTCPServerComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
 	StopListenServer();
 
 	Super::EndPlay(EndPlayReason);
-}
\ No newline at end of file
+}
@@ -0,0 +1,622 @@
+#include "TCPSharedMemoryRing.h"
+
+#if TCPWRAPPER_WITH_SHARED_MEMORY_RING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/** One direction's positions and flags, each written by one side only and kept on separate cache lines */
+struct FTCPSharedMemoryConnection::FRingControl
+{
+	volatile int64 WritePos;	//producer only, total bytes ever written
+	uint8 WritePad[56];
+	volatile int64 ReadPos;		//consumer only, total bytes ever read
+	uint8 ReadPad[56];
+	volatile int32 bWriterClosed;
+	volatile int32 bReaderClosed;
+	volatile int32 bReaderWaiting;	//consumer is (about to be) asleep, producer must signal after writing
+	volatile int32 bWriterWaiting;	//producer is (about to be) asleep, consumer must signal after reading
+	uint8 FlagPad[48];
+};
+
+namespace
+{
+	const uint32 RingMagic = 0x47525455;	//"UTRG"
+	const uint32 RingVersion = 1;
+	const int32 MinRingSize = 64 * 1024;
+	const int32 MaxRingSize = 1024 * 1024 * 1024;
+	const int64 RingDataOffset = 4096;
+	const int32 HandshakeTimeoutMs = 1000;
+	const int32 HandshakeFdCount = 3;
+
+	/** Sent over the unix socket along with the shared memory and both eventfds */
+	struct FRingHello
+	{
+		uint32 Magic;
+		uint32 Version;
+		uint64 RingSize;
+	};
+
+	FThreadSafeCounter NextSegment;
+
+	bool IsValidRingSize(uint64 Size)
+	{
+		return Size >= (uint64)MinRingSize && Size <= (uint64)MaxRingSize && FMath::IsPowerOfTwo(Size);
+	}
+
+	void Signal(int32 EventFd)
+	{
+		uint64 One = 1;
+		ssize_t Result;
+		do
+		{
+			Result = write(EventFd, &One, sizeof(One));
+		} while (Result < 0 && errno == EINTR);
+	}
+
+	void CloseFd(int32& Fd)
+	{
+		if (Fd >= 0)
+		{
+			close(Fd);
+			Fd = -1;
+		}
+	}
+}
+
+FTCPSharedMemoryConnection::FTCPSharedMemoryConnection(FTCPConnectionPtr InUnixConnection, int32 InRingSize)
+	: UnixConnection(InUnixConnection)
+	, RingSize(InRingSize)
+	, Mapping(nullptr)
+	, MappingSize(0)
+	, Tx(nullptr)
+	, Rx(nullptr)
+	, TxData(nullptr)
+	, RxData(nullptr)
+	, LocalEventFd(-1)
+	, PeerEventFd(-1)
+	, bReady(false)
+	, bClosed(false)
+	, bPeerGone(false)
+{
+}
+
+FTCPSharedMemoryConnection::~FTCPSharedMemoryConnection()
+{
+	if (Mapping)
+	{
+		munmap(Mapping, MappingSize);
+		Mapping = nullptr;
+	}
+	CloseFd(LocalEventFd);
+	CloseFd(PeerEventFd);
+}
+
+FTCPConnectionPtr FTCPSharedMemoryConnection::Create(const FString& Path, int32 RingSize)
+{
+	FTCPConnectionPtr Unix = FTCPConnection::CreateUnixSocket(Path);
+	if (!Unix.IsValid())
+	{
+		return nullptr;
+	}
+	const int32 Size = (int32)FMath::RoundUpToPowerOfTwo((uint32)FMath::Clamp(RingSize, MinRingSize, MaxRingSize));
+	return MakeShareable(new FTCPSharedMemoryConnection(Unix, Size));
+}
+
+FTCPConnectionPtr FTCPSharedMemoryConnection::FromAccepted(FTCPConnectionPtr UnixConnection)
+{
+	const int32 UnixFd = UnixConnection.IsValid() ? UnixConnection->GetNativeHandle() : -1;
+	if (UnixFd < 0)
+	{
+		return nullptr;
+	}
+
+	//the client sends its handshake right after connecting, don't hold the server thread up for long if it doesn't
+	pollfd Poll;
+	Poll.fd = UnixFd;
+	Poll.events = POLLIN;
+	Poll.revents = 0;
+	int32 Ready;
+	do
+	{
+		Ready = poll(&Poll, 1, HandshakeTimeoutMs);
+	} while (Ready < 0 && errno == EINTR);
+
+	if (Ready <= 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("TCPSharedMemoryRing: no handshake from client, is bUseSharedMemoryRing set on both sides?"));
+		return nullptr;
+	}
+
+	FRingHello Hello;
+	iovec Io;
+	Io.iov_base = &Hello;
+	Io.iov_len = sizeof(Hello);
+
+	union
+	{
+		cmsghdr Header;
+		uint8 Buffer[CMSG_SPACE(sizeof(int32) * HandshakeFdCount)];
+	} Control;
+	FMemory::Memzero(Control);
+
+	msghdr Message;
+	FMemory::Memzero(Message);
+	Message.msg_iov = &Io;
+	Message.msg_iovlen = 1;
+	Message.msg_control = Control.Buffer;
+	Message.msg_controllen = sizeof(Control.Buffer);
+
+	ssize_t Result;
+	do
+	{
+		Result = recvmsg(UnixFd, &Message, MSG_CMSG_CLOEXEC);
+	} while (Result < 0 && errno == EINTR);
+
+	int32 Fds[HandshakeFdCount] = { -1, -1, -1 };
+	int32 FdCount = 0;
+	for (cmsghdr* Cmsg = CMSG_FIRSTHDR(&Message); Cmsg; Cmsg = CMSG_NXTHDR(&Message, Cmsg))
+	{
+		if (Cmsg->cmsg_level == SOL_SOCKET && Cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			const int32 Count = (int32)((Cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int32));
+			for (int32 Index = 0; Index < Count; Index++)
+			{
+				int32 Fd;
+				FMemory::Memcpy(&Fd, CMSG_DATA(Cmsg) + Index * sizeof(int32), sizeof(int32));
+				if (FdCount < HandshakeFdCount)
+				{
+					Fds[FdCount++] = Fd;
+				}
+				else
+				{
+					close(Fd);
+				}
+			}
+		}
+	}
+
+	const bool bValidHello = Result == sizeof(Hello) && FdCount == HandshakeFdCount && !(Message.msg_flags & MSG_CTRUNC)
+		&& Hello.Magic == RingMagic && Hello.Version == RingVersion && IsValidRingSize(Hello.RingSize);
+
+	struct stat Info;
+	if (!bValidHello || fstat(Fds[0], &Info) != 0 || Info.st_size < RingDataOffset + 2 * (int64)Hello.RingSize)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("TCPSharedMemoryRing: invalid handshake from client, dropping it"));
+		for (int32& Fd : Fds)
+		{
+			CloseFd(Fd);
+		}
+		return nullptr;
+	}
+
+	TSharedPtr<FTCPSharedMemoryConnection, ESPMode::ThreadSafe> Connection = MakeShareable(new FTCPSharedMemoryConnection(UnixConnection, (int32)Hello.RingSize));
+	const bool bMapped = Connection->MapShared(Fds[0], Fds[1], Fds[2], true);
+	CloseFd(Fds[0]);
+	if (!bMapped)
+	{
+		return nullptr;
+	}
+	Connection->bReady = true;
+	return Connection;
+}
+
+bool FTCPSharedMemoryConnection::CreateShared()
+{
+	//named only for as long as it takes to open it, afterwards the descriptors are the only way in
+	const FString Name = FString::Printf(TEXT("/ue4-tcp-%d-%d"), (int32)getpid(), NextSegment.Increment());
+	int32 MemoryFd = shm_open(TCHAR_TO_UTF8(*Name), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (MemoryFd < 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("TCPSharedMemoryRing: shm_open failed with errno %d"), errno);
+		return false;
+	}
+	shm_unlink(TCHAR_TO_UTF8(*Name));
+
+	int32 ClientEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int32 ServerEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	const int64 Size = RingDataOffset + 2 * (int64)RingSize;
+	if (ClientEventFd < 0 || ServerEventFd < 0 || ftruncate(MemoryFd, Size) != 0 || !MapShared(MemoryFd, ClientEventFd, ServerEventFd, false))
+	{
+		UE_LOG(LogTemp, Error, TEXT("TCPSharedMemoryRing: unable to set up %d byte rings, errno %d"), RingSize, errno);
+		if (LocalEventFd < 0)
+		{
+			CloseFd(ClientEventFd);
+			CloseFd(ServerEventFd);
+		}
+		CloseFd(MemoryFd);
+		return false;
+	}
+
+	FRingHello Hello;
+	Hello.Magic = RingMagic;
+	Hello.Version = RingVersion;
+	Hello.RingSize = (uint64)RingSize;
+
+	iovec Io;
+	Io.iov_base = &Hello;
+	Io.iov_len = sizeof(Hello);
+
+	const int32 Fds[HandshakeFdCount] = { MemoryFd, ClientEventFd, ServerEventFd };
+	union
+	{
+		cmsghdr Header;
+		uint8 Buffer[CMSG_SPACE(sizeof(Fds))];
+	} Control;
+	FMemory::Memzero(Control);
+
+	msghdr Message;
+	FMemory::Memzero(Message);
+	Message.msg_iov = &Io;
+	Message.msg_iovlen = 1;
+	Message.msg_control = Control.Buffer;
+	Message.msg_controllen = sizeof(Control.Buffer);
+
+	cmsghdr* Cmsg = CMSG_FIRSTHDR(&Message);
+	Cmsg->cmsg_level = SOL_SOCKET;
+	Cmsg->cmsg_type = SCM_RIGHTS;
+	Cmsg->cmsg_len = CMSG_LEN(sizeof(Fds));
+	FMemory::Memcpy(CMSG_DATA(Cmsg), Fds, sizeof(Fds));
+
+	ssize_t Result;
+	do
+	{
+		Result = sendmsg(UnixConnection->GetNativeHandle(), &Message, MSG_NOSIGNAL);
+	} while (Result < 0 && errno == EINTR);
+
+	//the server holds its own copies now, the mapping keeps the memory alive on our side
+	CloseFd(MemoryFd);
+	return Result == sizeof(Hello);
+}
+
+bool FTCPSharedMemoryConnection::MapShared(int32 MemoryFd, int32 ClientEventFd, int32 ServerEventFd, bool bIsServer)
+{
+	//from here on the eventfds are ours to close
+	LocalEventFd = bIsServer ? ServerEventFd : ClientEventFd;
+	PeerEventFd = bIsServer ? ClientEventFd : ServerEventFd;
+
+	MappingSize = RingDataOffset + 2 * (int64)RingSize;
+	void* Address = mmap(nullptr, MappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, MemoryFd, 0);
+	if (Address == MAP_FAILED)
+	{
+		UE_LOG(LogTemp, Error, TEXT("TCPSharedMemoryRing: mmap of %lld bytes failed with errno %d"), MappingSize, errno);
+		return false;
+	}
+	Mapping = (uint8*)Address;
+
+	//header: magic, version, ring size, then the client->server and server->client ring controls
+	uint32* Magic = (uint32*)Mapping;
+	uint64* HeaderRingSize = (uint64*)(Mapping + 8);
+	FRingControl* Controls = (FRingControl*)(Mapping + 64);
+	static_assert(64 + 2 * sizeof(FRingControl) <= RingDataOffset, "ring controls must fit in front of the ring data");
+
+	if (bIsServer)
+	{
+		if (Magic[0] != RingMagic || Magic[1] != RingVersion || *HeaderRingSize != (uint64)RingSize)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("TCPSharedMemoryRing: shared memory header doesn't match the handshake"));
+			return false;
+		}
+	}
+	else
+	{
+		Magic[0] = RingMagic;
+		Magic[1] = RingVersion;
+		*HeaderRingSize = (uint64)RingSize;
+	}
+
+	Tx = &Controls[bIsServer ? 1 : 0];
+	Rx = &Controls[bIsServer ? 0 : 1];
+	TxData = Mapping + RingDataOffset + (bIsServer ? RingSize : 0);
+	RxData = Mapping + RingDataOffset + (bIsServer ? 0 : RingSize);
+	return true;
+}
+
+bool FTCPSharedMemoryConnection::Connect()
+{
+	if (bReady)
+	{
+		return true;
+	}
+	if (bClosed || !UnixConnection->Connect())
+	{
+		return false;
+	}
+
+	//connected but without rings the peer can't talk to us, give up on this connection
+	if (!CreateShared())
+	{
+		UE_LOG(LogTemp, Error, TEXT("TCPSharedMemoryRing: handshake with server failed"));
+		Close();
+		return false;
+	}
+	bReady = true;
+	return true;
+}
+
+bool FTCPSharedMemoryConnection::CanRead() const
+{
+	return bClosed || bPeerGone || FPlatformAtomics::AtomicRead(&Rx->bWriterClosed) || FPlatformAtomics::AtomicRead(&Rx->WritePos) != Rx->ReadPos;
+}
+
+bool FTCPSharedMemoryConnection::CanWrite() const
+{
+	return bClosed || bPeerGone || FPlatformAtomics::AtomicRead(&Tx->bReaderClosed) || Tx->bWriterClosed
+		|| Tx->WritePos - FPlatformAtomics::AtomicRead(&Tx->ReadPos) < RingSize;
+}
+
+void FTCPSharedMemoryConnection::Sleep(int32 TimeoutMs)
+{
+	//the peer never writes to the socket after the handshake, anything showing up there means it hung up
+	pollfd Polls[2];
+	Polls[0].fd = LocalEventFd;
+	Polls[0].events = POLLIN;
+	Polls[0].revents = 0;
+	Polls[1].fd = UnixConnection->GetNativeHandle();
+	Polls[1].events = POLLIN;
+	Polls[1].revents = 0;
+
+	int32 Result;
+	do
+	{
+		Result = poll(Polls, 2, TimeoutMs);
+	} while (Result < 0 && errno == EINTR);
+
+	if (Result > 0)
+	{
+		if (Polls[0].revents & POLLIN)
+		{
+			//nonblocking, just resets the counter so the next poll sleeps again
+			uint64 Count;
+			if (read(LocalEventFd, &Count, sizeof(Count)) < 0)
+			{
+				Count = 0;
+			}
+		}
+		if (Polls[1].revents)
+		{
+			bPeerGone = true;
+		}
+	}
+}
+
+void FTCPSharedMemoryConnection::WakePeer(volatile int32* WaitingFlag)
+{
+	//only costs a syscall if the peer said it was going to sleep
+	if (FPlatformAtomics::InterlockedCompareExchange(WaitingFlag, 0, 1) == 1)
+	{
+		Signal(PeerEventFd);
+	}
+}
+
+bool FTCPSharedMemoryConnection::Send(const uint8* Data, int32 Count, int32& BytesSent)
+{
+	BytesSent = 0;
+	if (!bReady)
+	{
+		return false;
+	}
+
+	FScopeLock ScopeLock(&SendLock);
+	while (BytesSent < Count)
+	{
+		if (bClosed || bPeerGone || Tx->bWriterClosed || FPlatformAtomics::AtomicRead(&Tx->bReaderClosed))
+		{
+			return false;
+		}
+
+		const int64 Write = Tx->WritePos;
+		const int64 Free = RingSize - (Write - FPlatformAtomics::AtomicRead(&Tx->ReadPos));
+		if (Free <= 0)
+		{
+			//blocks like a full socket would, Close() or the peer going away wakes us
+			FPlatformAtomics::InterlockedExchange(&Tx->bWriterWaiting, 1);
+			if (!CanWrite())
+			{
+				Sleep(-1);
+			}
+			continue;
+		}
+
+		const int32 Chunk = (int32)FMath::Min<int64>(Free, Count - BytesSent);
+		const int32 Start = (int32)(Write & (RingSize - 1));
+		const int32 First = FMath::Min(Chunk, RingSize - Start);
+		FMemory::Memcpy(TxData + Start, Data + BytesSent, First);
+		if (Chunk > First)
+		{
+			FMemory::Memcpy(TxData, Data + BytesSent + First, Chunk - First);
+		}
+
+		//publish only once the bytes are in place
+		FPlatformAtomics::AtomicStore(&Tx->WritePos, Write + Chunk);
+		WakePeer(&Tx->bReaderWaiting);
+		BytesSent += Chunk;
+	}
+	return true;
+}
+
+bool FTCPSharedMemoryConnection::Recv(uint8* Data, int32 BufferSize, int32& BytesRead)
+{
+	BytesRead = 0;
+	if (!bReady)
+	{
+		return false;
+	}
+
+	while (!bClosed)
+	{
+		const int64 Read = Rx->ReadPos;
+		const int64 Available = FPlatformAtomics::AtomicRead(&Rx->WritePos) - Read;
+		if (Available > 0)
+		{
+			const int32 Chunk = (int32)FMath::Min<int64>(Available, BufferSize);
+			const int32 Start = (int32)(Read & (RingSize - 1));
+			const int32 First = FMath::Min(Chunk, RingSize - Start);
+			FMemory::Memcpy(Data, RxData + Start, First);
+			if (Chunk > First)
+			{
+				FMemory::Memcpy(Data + First, RxData, Chunk - First);
+			}
+
+			FPlatformAtomics::AtomicStore(&Rx->ReadPos, Read + Chunk);
+			WakePeer(&Rx->bWriterWaiting);
+			BytesRead = Chunk;
+			return true;
+		}
+
+		//drained and the peer is done writing, same as a socket's end of stream
+		if (bPeerGone || FPlatformAtomics::AtomicRead(&Rx->bWriterClosed))
+		{
+			return false;
+		}
+
+		FPlatformAtomics::InterlockedExchange(&Rx->bReaderWaiting, 1);
+		if (!CanRead())
+		{
+			Sleep(-1);
+		}
+	}
+	return false;
+}
+
+bool FTCPSharedMemoryConnection::HasPendingData(uint32& PendingDataSize)
+{
+	PendingDataSize = 0;
+	if (!bReady || bClosed)
+	{
+		return false;
+	}
+	const int64 Available = FPlatformAtomics::AtomicRead(&Rx->WritePos) - Rx->ReadPos;
+	PendingDataSize = (uint32)FMath::Min<int64>(Available, MAX_uint32);
+	return PendingDataSize > 0;
+}
+
+bool FTCPSharedMemoryConnection::Wait(ESocketWaitConditions::Type Condition, FTimespan WaitTime)
+{
+	if (!bReady)
+	{
+		return false;
+	}
+
+	const bool bForRead = Condition != ESocketWaitConditions::WaitForWrite;
+	const bool bForWrite = Condition != ESocketWaitConditions::WaitForRead;
+	const double Deadline = FPlatformTime::Seconds() + WaitTime.GetTotalSeconds();
+
+	while (true)
+	{
+		if ((bForRead && CanRead()) || (bForWrite && CanWrite()))
+		{
+			return true;
+		}
+
+		const double Remaining = Deadline - FPlatformTime::Seconds();
+		if (Remaining <= 0.0)
+		{
+			return false;
+		}
+
+		//announce we're going to sleep, then check again so a wakeup can't slip in between
+		if (bForRead)
+		{
+			FPlatformAtomics::InterlockedExchange(&Rx->bReaderWaiting, 1);
+		}
+		if (bForWrite)
+		{
+			FPlatformAtomics::InterlockedExchange(&Tx->bWriterWaiting, 1);
+		}
+		if ((bForRead && CanRead()) || (bForWrite && CanWrite()))
+		{
+			return true;
+		}
+		Sleep(FMath::CeilToInt(Remaining * 1000.0));
+	}
+}
+
+ESocketConnectionState FTCPSharedMemoryConnection::GetConnectionState()
+{
+	if (!bReady || bClosed)
+	{
+		return ESocketConnectionState::SCS_NotConnected;
+	}
+
+	if (!bPeerGone)
+	{
+		pollfd Poll;
+		Poll.fd = UnixConnection->GetNativeHandle();
+		Poll.events = POLLIN;
+		Poll.revents = 0;
+		if (poll(&Poll, 1, 0) > 0 && Poll.revents)
+		{
+			bPeerGone = true;
+		}
+	}
+
+	//keep reporting connected while unread data remains so the receive loop still gets it
+	const bool bPeerDone = bPeerGone || FPlatformAtomics::AtomicRead(&Rx->bWriterClosed);
+	if (bPeerDone && FPlatformAtomics::AtomicRead(&Rx->WritePos) == Rx->ReadPos)
+	{
+		return ESocketConnectionState::SCS_NotConnected;
+	}
+	return ESocketConnectionState::SCS_Connected;
+}
+
+bool FTCPSharedMemoryConnection::SetSendBufferSize(int32 Size, int32& NewSize)
+{
+	//the rings are sized once at the handshake
+	NewSize = RingSize;
+	return true;
+}
+
+bool FTCPSharedMemoryConnection::SetReceiveBufferSize(int32 Size, int32& NewSize)
+{
+	NewSize = RingSize;
+	return true;
+}
+
+bool FTCPSharedMemoryConnection::Shutdown(ESocketShutdownMode Mode)
+{
+	if (!bReady)
+	{
+		return UnixConnection->Shutdown(Mode);
+	}
+
+	if (Mode != ESocketShutdownMode::Read)
+	{
+		FPlatformAtomics::InterlockedExchange(&Tx->bWriterClosed, 1);
+	}
+	if (Mode != ESocketShutdownMode::Write)
+	{
+		FPlatformAtomics::InterlockedExchange(&Rx->bReaderClosed, 1);
+	}
+
+	//the peer may be asleep on either ring
+	Signal(PeerEventFd);
+	return true;
+}
+
+bool FTCPSharedMemoryConnection::Close()
+{
+	if (bClosed)
+	{
+		return false;
+	}
+	bClosed = true;
+
+	if (bReady)
+	{
+		Shutdown(ESocketShutdownMode::ReadWrite);
+
+		//and one of our own threads may be asleep in Send/Recv
+		Signal(LocalEventFd);
+	}
+	UnixConnection->Close();
+	return true;
+}
+
+#endif
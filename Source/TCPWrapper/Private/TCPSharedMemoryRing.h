@@ -0,0 +1,74 @@
+#pragma once
+
+#include "TCPConnection.h"
+
+#if TCPWRAPPER_WITH_SHARED_MEMORY_RING
+
+/**
+* Same-host transport over two single producer/single consumer byte rings in shared memory,
+* one per direction. Bytes are copied straight into the peer's mapping, no syscall is made
+* unless one side is asleep waiting for data or space, in which case it is woken by eventfd.
+*
+* A unix domain socket is used to hand the client's shared memory and eventfds to the server
+* (SCM_RIGHTS) and afterwards only to notice the peer going away.
+*
+* Sends may come from several local threads and are serialized, reads must stay on one thread.
+*/
+class FTCPSharedMemoryConnection : public FTCPConnection
+{
+public:
+	/** Client side, Connect() connects to the unix socket at Path and sets up rings of RingSize bytes each way */
+	static FTCPConnectionPtr Create(const FString& Path, int32 RingSize);
+
+	/** Server side, reads the client's handshake off a freshly accepted unix socket. Returns null if it doesn't arrive. */
+	static FTCPConnectionPtr FromAccepted(FTCPConnectionPtr UnixConnection);
+
+	virtual ~FTCPSharedMemoryConnection();
+
+	virtual bool Connect() override;
+	virtual bool Send(const uint8* Data, int32 Count, int32& BytesSent) override;
+	virtual bool Recv(uint8* Data, int32 BufferSize, int32& BytesRead) override;
+	virtual bool HasPendingData(uint32& PendingDataSize) override;
+	virtual bool Wait(ESocketWaitConditions::Type Condition, FTimespan WaitTime) override;
+	virtual ESocketConnectionState GetConnectionState() override;
+	virtual bool SetSendBufferSize(int32 Size, int32& NewSize) override;
+	virtual bool SetReceiveBufferSize(int32 Size, int32& NewSize) override;
+	virtual bool Shutdown(ESocketShutdownMode Mode) override;
+	virtual bool Close() override;
+
+private:
+	struct FRingControl;
+
+	FTCPSharedMemoryConnection(FTCPConnectionPtr InUnixConnection, int32 InRingSize);
+
+	/** Create (client) or adopt (server) the mapping and eventfds, false on failure */
+	bool CreateShared();
+	bool MapShared(int32 MemoryFd, int32 ClientEventFd, int32 ServerEventFd, bool bIsServer);
+
+	bool CanRead() const;
+	bool CanWrite() const;
+
+	/** Sleep until the peer signals us, the peer goes away or Timeout (ms, -1 forever) runs out */
+	void Sleep(int32 TimeoutMs);
+	void WakePeer(volatile int32* WaitingFlag);
+
+	FTCPConnectionPtr UnixConnection;
+	int32 RingSize;
+
+	uint8* Mapping;
+	int64 MappingSize;
+	FRingControl* Tx;
+	FRingControl* Rx;
+	uint8* TxData;
+	uint8* RxData;
+
+	int32 LocalEventFd;	//we sleep on this
+	int32 PeerEventFd;	//the peer sleeps on this
+
+	FCriticalSection SendLock;
+	FThreadSafeBool bReady;
+	FThreadSafeBool bClosed;
+	FThreadSafeBool bPeerGone;
+};
+
+#endif
@@ -0,0 +1,175 @@
+#include "TCPStreamSource.h"
+#include "HAL/PlatformFilemanager.h"
+#include "Misc/Paths.h"
+
+#if PLATFORM_LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#endif
+
+FTCPStreamSource::FTCPStreamSource()
+	: NativeFd(-1)
+	, Size(0)
+	, Offset(0)
+{
+}
+
+FTCPStreamSourcePtr FTCPStreamSource::OpenFile(const FString& Path)
+{
+	FTCPStreamSourcePtr Source = MakeShareable(new FTCPStreamSource());
+
+#if PLATFORM_LINUX
+	//a raw descriptor lets us sendfile to native sockets and pread everywhere else
+	const FString FullPath = FPaths::ConvertRelativePathToFull(Path);
+	Source->NativeFd = open(TCHAR_TO_UTF8(*FullPath), O_RDONLY);
+	if (Source->NativeFd >= 0)
+	{
+		struct stat FileStat;
+		if (fstat(Source->NativeFd, &FileStat) == 0)
+		{
+			Source->Size = FileStat.st_size;
+			posix_fadvise(Source->NativeFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			return Source;
+		}
+		close(Source->NativeFd);
+		Source->NativeFd = -1;
+	}
+#endif
+
+	Source->Handle.Reset(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*Path));
+	if (!Source->Handle.IsValid())
+	{
+		UE_LOG(LogTemp, Warning, TEXT("TCPStreamSource: unable to open %s"), *Path);
+		return nullptr;
+	}
+	Source->Size = Source->Handle->Size();
+	return Source;
+}
+
+FTCPStreamSourcePtr FTCPStreamSource::FromHandle(TUniquePtr<IFileHandle> InHandle)
+{
+	if (!InHandle.IsValid())
+	{
+		return nullptr;
+	}
+	FTCPStreamSourcePtr Source = MakeShareable(new FTCPStreamSource());
+	Source->Size = FMath::Max<int64>(InHandle->Size() - InHandle->Tell(), 0);
+	Source->Handle = MoveTemp(InHandle);
+	return Source;
+}
+
+FTCPStreamSource::~FTCPStreamSource()
+{
+#if PLATFORM_LINUX
+	if (NativeFd >= 0)
+	{
+		close(NativeFd);
+	}
+#endif
+}
+
+bool FTCPStreamSource::Read(uint8* Dest, int32 Count)
+{
+	if (Offset + Count > Size)
+	{
+		return false;
+	}
+
+#if PLATFORM_LINUX
+	if (NativeFd >= 0)
+	{
+		int32 Done = 0;
+		while (Done < Count)
+		{
+			ssize_t Result = pread(NativeFd, Dest + Done, Count - Done, Offset + Done);
+			if (Result < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (Result <= 0)
+			{
+				return false;
+			}
+			Done += (int32)Result;
+		}
+		Offset += Count;
+		return true;
+	}
+#endif
+
+	if (Handle.IsValid() && Handle->Read(Dest, Count))
+	{
+		Offset += Count;
+		return true;
+	}
+	return false;
+}
+
+bool FTCPStreamSource::CanSendDirect(const FTCPConnection& Connection) const
+{
+#if PLATFORM_LINUX
+	return NativeFd >= 0 && Connection.GetNativeHandle() >= 0;
+#else
+	return false;
+#endif
+}
+
+bool FTCPStreamSource::SendDirect(FTCPConnection& Connection, int32 Count)
+{
+#if PLATFORM_LINUX
+	if (!CanSendDirect(Connection) || Offset + Count > Size)
+	{
+		return false;
+	}
+
+	//sendfile has no MSG_NOSIGNAL, block SIGPIPE on this thread so a peer hanging up can't kill the process
+	sigset_t PipeSet;
+	sigset_t OldSet;
+	sigset_t Pending;
+	sigemptyset(&PipeSet);
+	sigaddset(&PipeSet, SIGPIPE);
+	sigpending(&Pending);
+	const bool bPipeWasPending = sigismember(&Pending, SIGPIPE) == 1;
+	pthread_sigmask(SIG_BLOCK, &PipeSet, &OldSet);
+
+	off_t FileOffset = Offset;
+	int32 Remaining = Count;
+	bool bBrokenPipe = false;
+	while (Remaining > 0)
+	{
+		ssize_t Result = sendfile(Connection.GetNativeHandle(), NativeFd, &FileOffset, Remaining);
+		if (Result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (Result <= 0)
+		{
+			bBrokenPipe = Result < 0 && errno == EPIPE;
+			break;
+		}
+		Remaining -= (int32)Result;
+	}
+
+	//swallow the SIGPIPE we caused before unblocking, otherwise it is delivered right away
+	if (bBrokenPipe && !bPipeWasPending)
+	{
+		const struct timespec NoWait = { 0, 0 };
+		sigtimedwait(&PipeSet, nullptr, &NoWait);
+	}
+	pthread_sigmask(SIG_SETMASK, &OldSet, nullptr);
+
+	if (Remaining > 0)
+	{
+		return false;
+	}
+	Offset += Count;
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GenericPlatform/GenericPlatformFile.h"
+#include "TCPConnection.h"
+
+/**
+* Sequential reader for a payload streamed from disk. Only ever holds one frame of the
+* file in memory, and on Linux can skip user space entirely by sendfile-ing to native sockets.
+*/
+class FTCPStreamSource
+{
+public:
+	/** Open a file for streaming, returns null if it can't be read */
+	static TSharedPtr<FTCPStreamSource, ESPMode::ThreadSafe> OpenFile(const FString& Path);
+
+	/** Stream from an already open handle, reading from its current position to the end */
+	static TSharedPtr<FTCPStreamSource, ESPMode::ThreadSafe> FromHandle(TUniquePtr<IFileHandle> InHandle);
+
+	~FTCPStreamSource();
+
+	/** Total bytes this source will produce */
+	int64 GetSize() const { return Size; }
+
+	/** Read the next Count bytes into Dest */
+	bool Read(uint8* Dest, int32 Count);
+
+	/** True if the next bytes can go from file to socket inside the kernel */
+	bool CanSendDirect(const FTCPConnection& Connection) const;
+
+	/** Send the next Count bytes straight from the file to the connection */
+	bool SendDirect(FTCPConnection& Connection, int32 Count);
+
+private:
+	FTCPStreamSource();
+
+	TUniquePtr<IFileHandle> Handle;
+	int32 NativeFd;
+	int64 Size;
+	int64 Offset;
+};
+
+typedef TSharedPtr<FTCPStreamSource, ESPMode::ThreadSafe> FTCPStreamSourcePtr;
@@ -0,0 +1,394 @@
+#include "TCPUnixSocket.h"
+
+#if TCPWRAPPER_WITH_UNIX_SOCKETS
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0	//mac uses SO_NOSIGPIPE instead, set on creation
+#endif
+
+namespace
+{
+	bool FillUnixAddress(const FString& Path, sockaddr_un& OutAddress)
+	{
+		FMemory::Memzero(OutAddress);
+		OutAddress.sun_family = AF_UNIX;
+
+		FTCHARToUTF8 Converted(*Path);
+		if (Converted.Length() <= 0 || Converted.Length() >= (int32)sizeof(OutAddress.sun_path))
+		{
+			UE_LOG(LogTemp, Error, TEXT("TCPUnixSocket: invalid socket path '%s'"), *Path);
+			return false;
+		}
+		FMemory::Memcpy(OutAddress.sun_path, Converted.Get(), Converted.Length());
+		return true;
+	}
+
+	int32 CreateUnixStreamSocket()
+	{
+		int32 Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+#ifdef SO_NOSIGPIPE
+		if (Fd >= 0)
+		{
+			int32 One = 1;
+			setsockopt(Fd, SOL_SOCKET, SO_NOSIGPIPE, &One, sizeof(One));
+		}
+#endif
+		return Fd;
+	}
+
+	//returns poll revents or -1 on error
+	int32 PollFd(int32 Fd, int16 Events, FTimespan WaitTime)
+	{
+		pollfd Poll;
+		Poll.fd = Fd;
+		Poll.events = Events;
+		Poll.revents = 0;
+
+		const int32 TimeoutMs = FMath::CeilToInt(WaitTime.GetTotalMilliseconds());
+		int32 Result;
+		do
+		{
+			Result = poll(&Poll, 1, TimeoutMs);
+		} while (Result < 0 && errno == EINTR);
+
+		if (Result < 0)
+		{
+			return -1;
+		}
+		return Result == 0 ? 0 : Poll.revents;
+	}
+
+	//a socket file left behind by a server that died may be replaced, anything else at the path may not
+	bool ClearStaleSocketFile(const FString& Path, const sockaddr_un& Address)
+	{
+		struct stat Info;
+		if (lstat(Address.sun_path, &Info) != 0)
+		{
+			return errno == ENOENT;
+		}
+		if (!S_ISSOCK(Info.st_mode))
+		{
+			UE_LOG(LogTemp, Error, TEXT("TCPUnixSocket: '%s' exists and is not a socket, not replacing it"), *Path);
+			return false;
+		}
+
+		//only a refused connect means nobody is listening there any more
+		int32 ProbeFd = CreateUnixStreamSocket();
+		if (ProbeFd < 0)
+		{
+			return false;
+		}
+		int32 Result;
+		do
+		{
+			Result = connect(ProbeFd, (const sockaddr*)&Address, sizeof(Address));
+		} while (Result != 0 && errno == EINTR);
+		const int32 ConnectError = Result == 0 ? 0 : errno;
+		close(ProbeFd);
+
+		if (ConnectError != ECONNREFUSED)
+		{
+			UE_LOG(LogTemp, Error, TEXT("TCPUnixSocket: '%s' is in use by another server"), *Path);
+			return false;
+		}
+		return unlink(Address.sun_path) == 0;
+	}
+}
+
+FTCPUnixConnection::FTCPUnixConnection(int32 InFd, const FString& InPath, bool bInConnected)
+	: Fd(InFd)
+	, Path(InPath)
+	, bConnected(bInConnected)
+	, bClosed(false)
+{
+}
+
+FTCPConnectionPtr FTCPUnixConnection::Create(const FString& Path)
+{
+	int32 NewFd = CreateUnixStreamSocket();
+	if (NewFd < 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("TCPUnixSocket: socket() failed with errno %d"), errno);
+		return nullptr;
+	}
+	return MakeShareable(new FTCPUnixConnection(NewFd, Path, false));
+}
+
+FTCPConnectionPtr FTCPUnixConnection::FromAccepted(int32 InFd)
+{
+#ifdef SO_NOSIGPIPE
+	int32 One = 1;
+	setsockopt(InFd, SOL_SOCKET, SO_NOSIGPIPE, &One, sizeof(One));
+#endif
+	return MakeShareable(new FTCPUnixConnection(InFd, FString(), true));
+}
+
+FTCPUnixConnection::~FTCPUnixConnection()
+{
+	if (Fd >= 0)
+	{
+		close(Fd);
+		Fd = -1;
+	}
+}
+
+bool FTCPUnixConnection::Connect()
+{
+	sockaddr_un Address;
+	if (Fd < 0 || bClosed || !FillUnixAddress(Path, Address))
+	{
+		return false;
+	}
+
+	//a failed connect leaves an AF_UNIX socket unconnected, so the same descriptor can retry later
+	if (connect(Fd, (sockaddr*)&Address, sizeof(Address)) == 0)
+	{
+		bConnected = true;
+		return true;
+	}
+	return false;
+}
+
+bool FTCPUnixConnection::Send(const uint8* Data, int32 Count, int32& BytesSent)
+{
+	BytesSent = 0;
+	if (Fd < 0)
+	{
+		return false;
+	}
+
+	while (BytesSent < Count)
+	{
+		ssize_t Result = send(Fd, Data + BytesSent, Count - BytesSent, MSG_NOSIGNAL);
+		if (Result < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EPIPE || errno == ECONNRESET)
+			{
+				bConnected = false;
+			}
+			return false;
+		}
+		BytesSent += (int32)Result;
+	}
+	return true;
+}
+
+bool FTCPUnixConnection::Recv(uint8* Data, int32 BufferSize, int32& BytesRead)
+{
+	BytesRead = 0;
+	if (Fd < 0)
+	{
+		return false;
+	}
+
+	ssize_t Result;
+	do
+	{
+		Result = recv(Fd, Data, BufferSize, 0);
+	} while (Result < 0 && errno == EINTR);
+
+	if (Result <= 0)
+	{
+		//0 is an orderly shutdown from the peer
+		if (Result == 0 || errno == ECONNRESET)
+		{
+			bConnected = false;
+		}
+		return false;
+	}
+	BytesRead = (int32)Result;
+	return true;
+}
+
+bool FTCPUnixConnection::HasPendingData(uint32& PendingDataSize)
+{
+	PendingDataSize = 0;
+	int32 Available = 0;
+	if (Fd < 0 || ioctl(Fd, FIONREAD, &Available) != 0)
+	{
+		return false;
+	}
+	PendingDataSize = (uint32)FMath::Max(Available, 0);
+	return PendingDataSize > 0;
+}
+
+bool FTCPUnixConnection::Wait(ESocketWaitConditions::Type Condition, FTimespan WaitTime)
+{
+	if (Fd < 0)
+	{
+		return false;
+	}
+
+	int16 Events = 0;
+	switch (Condition)
+	{
+	case ESocketWaitConditions::WaitForRead:
+		Events = POLLIN;
+		break;
+	case ESocketWaitConditions::WaitForWrite:
+		Events = POLLOUT;
+		break;
+	default:
+		Events = POLLIN | POLLOUT;
+		break;
+	}
+	return PollFd(Fd, Events, WaitTime) > 0;
+}
+
+ESocketConnectionState FTCPUnixConnection::GetConnectionState()
+{
+	if (Fd < 0 || !bConnected)
+	{
+		return ESocketConnectionState::SCS_NotConnected;
+	}
+
+	//unlike the engine sockets we can actually see the peer hanging up, but keep reporting
+	//connected while unread data remains so the receive loop still gets it
+	const int32 Events = PollFd(Fd, POLLIN, FTimespan::Zero());
+	if (Events < 0 || (Events & (POLLHUP | POLLERR)))
+	{
+		uint32 Pending = 0;
+		if (!HasPendingData(Pending))
+		{
+			bConnected = false;
+			return ESocketConnectionState::SCS_NotConnected;
+		}
+	}
+	return ESocketConnectionState::SCS_Connected;
+}
+
+bool FTCPUnixConnection::SetSendBufferSize(int32 Size, int32& NewSize)
+{
+	socklen_t OptionSize = sizeof(NewSize);
+	bool bOk = setsockopt(Fd, SOL_SOCKET, SO_SNDBUF, &Size, sizeof(Size)) == 0;
+	getsockopt(Fd, SOL_SOCKET, SO_SNDBUF, &NewSize, &OptionSize);
+	return bOk;
+}
+
+bool FTCPUnixConnection::SetReceiveBufferSize(int32 Size, int32& NewSize)
+{
+	socklen_t OptionSize = sizeof(NewSize);
+	bool bOk = setsockopt(Fd, SOL_SOCKET, SO_RCVBUF, &Size, sizeof(Size)) == 0;
+	getsockopt(Fd, SOL_SOCKET, SO_RCVBUF, &NewSize, &OptionSize);
+	return bOk;
+}
+
+bool FTCPUnixConnection::Shutdown(ESocketShutdownMode Mode)
+{
+	int32 How = SHUT_RDWR;
+	if (Mode == ESocketShutdownMode::Read)
+	{
+		How = SHUT_RD;
+	}
+	else if (Mode == ESocketShutdownMode::Write)
+	{
+		How = SHUT_WR;
+	}
+	return Fd >= 0 && shutdown(Fd, How) == 0;
+}
+
+bool FTCPUnixConnection::Close()
+{
+	//the descriptor stays open until destruction so another thread can't end up using a reused fd
+	if (Fd >= 0 && !bClosed)
+	{
+		bClosed = true;
+		bConnected = false;
+		shutdown(Fd, SHUT_RDWR);
+		return true;
+	}
+	return false;
+}
+
+FTCPUnixListener::FTCPUnixListener(int32 InFd, const FString& InPath)
+	: Fd(InFd)
+	, Path(InPath)
+{
+}
+
+TSharedPtr<FTCPUnixListener, ESPMode::ThreadSafe> FTCPUnixListener::Listen(const FString& Path, int32 Backlog)
+{
+	sockaddr_un Address;
+	if (!FillUnixAddress(Path, Address))
+	{
+		return nullptr;
+	}
+
+	//a previous run that didn't shut down cleanly leaves the socket file behind and bind would fail
+	if (!ClearStaleSocketFile(Path, Address))
+	{
+		return nullptr;
+	}
+
+	int32 NewFd = CreateUnixStreamSocket();
+	if (NewFd < 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("TCPUnixSocket: socket() failed with errno %d"), errno);
+		return nullptr;
+	}
+
+	if (bind(NewFd, (sockaddr*)&Address, sizeof(Address)) != 0 || listen(NewFd, Backlog) != 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("TCPUnixSocket: unable to listen on '%s', errno %d"), *Path, errno);
+		close(NewFd);
+		return nullptr;
+	}
+
+	return MakeShareable(new FTCPUnixListener(NewFd, Path));
+}
+
+FTCPUnixListener::~FTCPUnixListener()
+{
+	Close();
+}
+
+bool FTCPUnixListener::HasPendingConnection(bool& bHasPendingConnection)
+{
+	bHasPendingConnection = false;
+	if (Fd < 0)
+	{
+		return false;
+	}
+	const int32 Events = PollFd(Fd, POLLIN, FTimespan::Zero());
+	bHasPendingConnection = Events > 0 && (Events & POLLIN);
+	return Events >= 0;
+}
+
+FTCPConnectionPtr FTCPUnixListener::Accept()
+{
+	int32 ClientFd;
+	do
+	{
+		ClientFd = accept(Fd, nullptr, nullptr);
+	} while (ClientFd < 0 && errno == EINTR);
+
+	if (ClientFd < 0)
+	{
+		return nullptr;
+	}
+	return FTCPUnixConnection::FromAccepted(ClientFd);
+}
+
+void FTCPUnixListener::Close()
+{
+	if (Fd >= 0)
+	{
+		close(Fd);
+		Fd = -1;
+		unlink(TCHAR_TO_UTF8(*Path));
+	}
+}
+
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "TCPConnection.h"
+
+#if TCPWRAPPER_WITH_UNIX_SOCKETS
+
+/**
+* AF_UNIX stream socket for same-host peers. Skips the loopback TCP stack entirely,
+* otherwise behaves like a blocking FSocket from the components' point of view.
+*/
+class FTCPUnixConnection : public FTCPConnection
+{
+public:
+	/** Create an unconnected socket which will connect to Path */
+	static FTCPConnectionPtr Create(const FString& Path);
+
+	/** Wrap an already connected descriptor e.g. from accept() */
+	static FTCPConnectionPtr FromAccepted(int32 InFd);
+
+	virtual ~FTCPUnixConnection();
+
+	virtual bool Connect() override;
+	virtual bool Send(const uint8* Data, int32 Count, int32& BytesSent) override;
+	virtual bool Recv(uint8* Data, int32 BufferSize, int32& BytesRead) override;
+	virtual bool HasPendingData(uint32& PendingDataSize) override;
+	virtual bool Wait(ESocketWaitConditions::Type Condition, FTimespan WaitTime) override;
+	virtual ESocketConnectionState GetConnectionState() override;
+	virtual bool SetSendBufferSize(int32 Size, int32& NewSize) override;
+	virtual bool SetReceiveBufferSize(int32 Size, int32& NewSize) override;
+	virtual bool Shutdown(ESocketShutdownMode Mode) override;
+	virtual bool Close() override;
+	virtual int32 GetNativeHandle() const override { return Fd; }
+
+private:
+	FTCPUnixConnection(int32 InFd, const FString& InPath, bool bInConnected);
+
+	int32 Fd;
+	FString Path;
+	FThreadSafeBool bConnected;
+	FThreadSafeBool bClosed;
+};
+
+/** Listening AF_UNIX socket, mirrors the subset of FSocket the server component uses */
+class FTCPUnixListener
+{
+public:
+	/** Bind and listen at Path, removing a stale socket file if one is left over. Returns null on failure. */
+	static TSharedPtr<FTCPUnixListener, ESPMode::ThreadSafe> Listen(const FString& Path, int32 Backlog);
+
+	~FTCPUnixListener();
+
+	bool HasPendingConnection(bool& bHasPendingConnection);
+	FTCPConnectionPtr Accept();
+	void Close();
+
+	const FString& GetPath() const { return Path; }
+
+private:
+	FTCPUnixListener(int32 InFd, const FString& InPath);
+
+	int32 Fd;
+	FString Path;
+};
+
+#endif
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "Stats/Stats.h"
+
+DECLARE_STATS_GROUP(TEXT("TCPWrapper"), STATGROUP_TCPWrapper, STATCAT_Advanced);
+
+DECLARE_DWORD_ACCUMULATOR_STAT_EXTERN(TEXT("Connections"), STAT_TCPConnections, STATGROUP_TCPWrapper, );
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Socket Buffers (kernel)"), STAT_TCPKernelBufferMemory, STATGROUP_TCPWrapper, );
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Receive/Send Buffers (user)"), STAT_TCPUserBufferMemory, STATGROUP_TCPWrapper, );
@@ -0,0 +1,73 @@
+#include "TCPWrapperTrace.h"
+
+#if UE_TRACE_ENABLED
+
+UE_TRACE_CHANNEL_DEFINE(TCPWrapperChannel)
+
+UE_TRACE_EVENT_BEGIN(TCPWrapper, MessageQueued)
+	UE_TRACE_EVENT_FIELD(uint64, EnqueueCycle)
+	UE_TRACE_EVENT_FIELD(uint64, Size)
+	UE_TRACE_EVENT_FIELD(uint32, ConnectionId)
+	UE_TRACE_EVENT_FIELD(uint8, Lane)
+UE_TRACE_EVENT_END()
+
+UE_TRACE_EVENT_BEGIN(TCPWrapper, MessageSent)
+	UE_TRACE_EVENT_FIELD(uint64, EnqueueCycle)
+	UE_TRACE_EVENT_FIELD(uint64, DequeueCycle)
+	UE_TRACE_EVENT_FIELD(uint64, SentCycle)
+	UE_TRACE_EVENT_FIELD(uint64, Size)
+	UE_TRACE_EVENT_FIELD(uint32, ConnectionId)
+	UE_TRACE_EVENT_FIELD(uint8, Lane)
+UE_TRACE_EVENT_END()
+
+UE_TRACE_EVENT_BEGIN(TCPWrapper, MessageReceived)
+	UE_TRACE_EVENT_FIELD(uint64, ReceiveCycle)
+	UE_TRACE_EVENT_FIELD(uint64, Size)
+	UE_TRACE_EVENT_FIELD(uint32, ConnectionId)
+UE_TRACE_EVENT_END()
+
+UE_TRACE_EVENT_BEGIN(TCPWrapper, MessageDispatched)
+	UE_TRACE_EVENT_FIELD(uint64, ReceiveCycle)
+	UE_TRACE_EVENT_FIELD(uint64, DispatchCycle)
+	UE_TRACE_EVENT_FIELD(uint64, Size)
+	UE_TRACE_EVENT_FIELD(uint32, ConnectionId)
+UE_TRACE_EVENT_END()
+
+void FTCPWrapperTrace::MessageQueued(uint32 ConnectionId, uint8 Lane, uint64 Size, uint64 EnqueueCycle)
+{
+	UE_TRACE_LOG(TCPWrapper, MessageQueued, TCPWrapperChannel)
+		<< MessageQueued.EnqueueCycle(EnqueueCycle)
+		<< MessageQueued.Size(Size)
+		<< MessageQueued.ConnectionId(ConnectionId)
+		<< MessageQueued.Lane(Lane);
+}
+
+void FTCPWrapperTrace::MessageSent(uint32 ConnectionId, uint8 Lane, uint64 Size, uint64 EnqueueCycle, uint64 DequeueCycle)
+{
+	UE_TRACE_LOG(TCPWrapper, MessageSent, TCPWrapperChannel)
+		<< MessageSent.EnqueueCycle(EnqueueCycle)
+		<< MessageSent.DequeueCycle(DequeueCycle)
+		<< MessageSent.SentCycle(FPlatformTime::Cycles64())
+		<< MessageSent.Size(Size)
+		<< MessageSent.ConnectionId(ConnectionId)
+		<< MessageSent.Lane(Lane);
+}
+
+void FTCPWrapperTrace::MessageReceived(uint32 ConnectionId, uint64 Size, uint64 ReceiveCycle)
+{
+	UE_TRACE_LOG(TCPWrapper, MessageReceived, TCPWrapperChannel)
+		<< MessageReceived.ReceiveCycle(ReceiveCycle)
+		<< MessageReceived.Size(Size)
+		<< MessageReceived.ConnectionId(ConnectionId);
+}
+
+void FTCPWrapperTrace::MessageDispatched(uint32 ConnectionId, uint64 Size, uint64 ReceiveCycle)
+{
+	UE_TRACE_LOG(TCPWrapper, MessageDispatched, TCPWrapperChannel)
+		<< MessageDispatched.ReceiveCycle(ReceiveCycle)
+		<< MessageDispatched.DispatchCycle(FPlatformTime::Cycles64())
+		<< MessageDispatched.Size(Size)
+		<< MessageDispatched.ConnectionId(ConnectionId);
+}
+
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Trace/Trace.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+
+/**
+* Unreal Insights instrumentation on the TCPWrapper trace channel, enable it with -trace=cpu,TCPWrapper
+* or Trace.Enable at runtime. CPU scopes show up in Timing Insights next to game thread work, the
+* message events carry connection id, size and cycle timestamps for each message's trip through the queues.
+*
+* Compiles out without UE_TRACE_ENABLED, otherwise costs a channel check while the channel is off.
+*/
+#if UE_TRACE_ENABLED
+
+UE_TRACE_CHANNEL_EXTERN(TCPWrapperChannel)
+
+struct FTCPWrapperTrace
+{
+	/** Message handed to a connection's lanes */
+	static void MessageQueued(uint32 ConnectionId, uint8 Lane, uint64 Size, uint64 EnqueueCycle);
+
+	/** Last byte of a message went out, DequeueCycle is when its first frame left the queue */
+	static void MessageSent(uint32 ConnectionId, uint8 Lane, uint64 Size, uint64 EnqueueCycle, uint64 DequeueCycle);
+
+	/** Message (or raw chunk when unframed) read off the socket */
+	static void MessageReceived(uint32 ConnectionId, uint64 Size, uint64 ReceiveCycle);
+
+	/** Received message broadcast through OnReceivedBytes */
+	static void MessageDispatched(uint32 ConnectionId, uint64 Size, uint64 ReceiveCycle);
+};
+
+#define TCPWRAPPER_TRACE_SCOPE(Name) TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL_STR(TEXT("TCPWrapper::") TEXT(#Name), TCPWrapperChannel)
+#define TCPWRAPPER_TRACE_MESSAGE(Event, ...) do { if (UE_TRACE_CHANNELEXPR_IS_ENABLED(TCPWrapperChannel)) { FTCPWrapperTrace::Event(__VA_ARGS__); } } while (0)
+
+#else
+
+#define TCPWRAPPER_TRACE_SCOPE(Name)
+#define TCPWRAPPER_TRACE_MESSAGE(Event, ...) do { } while (0)
+
+#endif
@@ -6,6 +6,7 @@
 #include "TCPServerComponent.h"
 #include "TCPClientComponent.generated.h"
 
+class FTCPClientSession;
 
 UCLASS(ClassGroup = "Networking", meta = (BlueprintSpawnableComponent))
 class TCPWRAPPER_API UTCPClientComponent : public UActorComponent
@@ -27,6 +28,22 @@ public:
 	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
 	FTCPEventSignature OnDisconnected;
 
+	/** Called once CloseSocket has finished flushing and closing the connection */
+	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
+	FTCPEventSignature OnShutdownComplete;
+
+	/** A streamed transfer was fully written to ReceiveFileDirectory */
+	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
+	FTCPFileSignature OnReceivedFile;
+
+	/** Progress of an EmitFile/EmitStream transfer, reported about every percent */
+	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
+	FTCPProgressSignature OnSendProgress;
+
+	/** Progress of an incoming streamed transfer, reported about every percent */
+	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
+	FTCPProgressSignature OnReceiveProgress;
+
 	/** Default sending socket IP string in form e.g. 127.0.0.1. */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
 	FString ConnectionIP;
@@ -37,10 +54,56 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
 	FString ClientSocketName;
 
-	/** in bytes */
+	/** Connect to a unix domain socket at UnixSocketPath instead of IP/port. For same-host peers on Linux/Mac only. */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	bool bUseUnixDomainSocket;
+
+	/** Filesystem path of the unix domain socket e.g. /tmp/ue4-tcp.sock */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	FString UnixSocketPath;
+
+	/**
+	* Exchange bytes through shared memory rings instead of the socket, which is then only used to set them up.
+	* Needs bUseUnixDomainSocket and the same setting on the peer. Linux only.
+	*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	bool bUseSharedMemoryRing;
+
+	/** in bytes, size of each direction's ring, rounded up to a power of two. The server uses whatever the client asks for. */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	int32 SharedMemoryRingSize;
+
+	/** in bytes, upper bound for the socket buffers */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
 	int32 BufferMaxSize;
 
+	/**
+	* Size socket buffers per connection from observed throughput instead of always reserving BufferMaxSize.
+	* Setting sizes turns off Linux's own buffer autotuning and the receive window is mostly fixed at connect,
+	* so on high bandwidth-delay links (round trip longer than BufferTargetLatency) turn this off instead.
+	*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	bool bAdaptiveBufferSizing;
+
+	/** in bytes, buffers start here and idle connections shrink back to it */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	int32 MinBufferSize;
+
+	/** Seconds of observed throughput the socket buffers should be able to hold, buffers only grow while this is longer than the round trip */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	float BufferTargetLatency;
+
+	/**
+	* Socket buffer growth + queued sends this component may use across all connections, Emit fails once it's used up.
+	* Each connection's MinBufferSize buffers are always granted on top of this. 0 for unlimited
+	*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	int32 MemoryBudgetMB;
+
+	/** Seconds CloseSocket keeps flushing queued sends and waiting for the server to close before dropping the connection */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	float ShutdownTimeout;
+
 	/** If true will auto-connect on begin play to IP/port specified as a client. */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
 	bool bShouldAutoConnectOnBeginPlay;
@@ -57,6 +120,29 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
 	bool bAutoReconnectOnSendFailure;
 
+	/** Frame messages into priority lanes so small control messages don't queue behind bulk transfers. Both peers must enable this. */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	bool bUsePriorityLanes;
+
+	/** Max payload bytes per lane frame, smaller frames interleave lanes more finely at the cost of more headers */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	int32 LaneFrameSize;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	ETCPLaneScheduling LaneScheduling;
+
+	/** Relative frame share of the Control, Normal and Bulk lanes when using weighted scheduling */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	TArray<int32> LaneWeights;
+
+	/** Streamed transfers from framed peers are written to files here. Without it they are refused (read and dropped). */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	FString ReceiveFileDirectory;
+
+	/** in bytes, framed messages larger than this are dropped instead of being reassembled in memory */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	int32 MaxReceiveMessageSize;
+
 
 	/**
 	* Connect to a TCP endpoint, optional method if auto-connect is set to true.
@@ -71,6 +157,7 @@ public:
 
 	/**
 	* Close the sending socket. This is usually automatically done on endplay.
+	* Returns straight away, queued sends are flushed in the background until OnShutdownComplete.
 	*/
 	UFUNCTION(BlueprintCallable, Category = "TCP Functions")
 	void CloseSocket();
@@ -79,23 +166,63 @@ public:
 	* Emit specified bytes to the TCP channel.
 	*
 	* @param Message	Bytes
+	* @param Priority	Lane to send on, only used with bUsePriorityLanes
+	* @return false if the send failed or queueing it would go over MemoryBudgetMB
 	*/
 	UFUNCTION(BlueprintCallable, Category = "TCP Functions")
-	bool Emit(const TArray<uint8>& Bytes);
+	bool Emit(const TArray<uint8>& Bytes, ETCPMessagePriority Priority = ETCPMessagePriority::Normal);
+
+	/**
+	* Stream a file to the TCP channel from the socket thread without loading it into memory.
+	*
+	* @param FilePath	File to send
+	* @param Priority	Lane to send on, only used with bUsePriorityLanes
+	* @return transfer id reported by OnSendProgress, -1 if not connected or the file couldn't be opened
+	*/
+	UFUNCTION(BlueprintCallable, Category = "TCP Functions")
+	int32 EmitFile(const FString& FilePath, ETCPMessagePriority Priority = ETCPMessagePriority::Bulk);
+
+	/**
+	* Stream the rest of an open file handle, takes ownership of the handle.
+	* @return transfer id reported by OnSendProgress, -1 if not connected
+	*/
+	int32 EmitStream(TUniquePtr<IFileHandle> Handle, ETCPMessagePriority Priority = ETCPMessagePriority::Bulk);
 	
+	/** False once CloseSocket has been called, even while the connection is still draining */
 	UFUNCTION(BlueprintPure, Category = "TCP Functions")
 	bool IsConnected();
 
+	/** Current socket buffer memory use */
+	UFUNCTION(BlueprintPure, Category = "TCP Functions")
+	FTCPMemoryStats GetMemoryStats();
+
 	virtual void InitializeComponent() override;
 	virtual void UninitializeComponent() override;
 	virtual void BeginPlay() override;
 	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 	
 protected:
-	FSocket* ClientSocket;
-	FThreadSafeBool bShouldReceiveData;
-	FThreadSafeBool bShouldAttemptConnection;
-	TFuture<void> ClientConnectionFinishedFuture;
+	friend class FTCPClientSession;
+
+	/** Disconnect/reconnect as configured after a failed send */
+	void HandleSendFailure();
+
+	/** Game thread side of the connection thread finishing, releases the connection and reports it */
+	void FinishShutdown(TSharedPtr<FTCPClientSession, ESPMode::ThreadSafe> FinishedSession);
+
+	/** State shared with the connection thread while connected, the thread keeps it alive until it has drained */
+	TSharedPtr<FTCPClientSession, ESPMode::ThreadSafe> Session;
+	FThreadSafeCounter TransferCount;
+	TSharedPtr<FTCPBufferBudget, ESPMode::ThreadSafe> BufferBudget;
+	FThreadSafeBool bIsShuttingDown;
+
+	//ConnectToSocketAsClient called while the previous connection was still shutting down
+	bool bConnectAfterShutdown;
+	FString PendingConnectIP;
+	int32 PendingConnectPort;
+
+	//set from EndPlay until the next BeginPlay, no connection may be started meanwhile
+	bool bHasEndedPlay;
 
 	//FTCPSocketReceiver* TCPReceiver;
 	FString SocketDescription;
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/ScopeRWLock.h"
+
+struct FTCPClient;
+
+typedef TSharedPtr<FTCPClient, ESPMode::ThreadSafe> FTCPClientPtr;
+typedef TMap<FString, FTCPClientPtr> FTCPClientMap;
+typedef TSharedRef<const FTCPClientMap, ESPMode::ThreadSafe> FTCPClientSnapshot;
+
+/**
+* Connected clients, readable from any thread.
+*
+* Writers (accept, disconnect) copy the current map, modify the copy and publish it as the new
+* version. Readers just take a reference to whichever version is current and iterate it without
+* further locking; an old version stays alive for as long as someone still holds it. The only
+* shared state readers touch is the pointer to the current version, guarded by a reader/writer
+* lock that is held for a single reference count increment.
+*/
+class TCPWRAPPER_API FTCPClientRegistry
+{
+public:
+	FTCPClientRegistry();
+
+	/** Immutable view of all clients at this moment */
+	FTCPClientSnapshot Snapshot() const;
+
+	FTCPClientPtr Find(const FString& Address) const;
+	int32 Num() const;
+
+	void Add(const FString& Address, FTCPClientPtr Client);
+
+	/** @return the removed client, null if it wasn't registered */
+	FTCPClientPtr Remove(const FString& Address);
+
+	/** @return every client that was registered */
+	FTCPClientSnapshot Empty();
+
+private:
+	void Publish(const FTCPClientSnapshot& NewVersion);
+
+	/** Serializes writers so no update is lost between copy and publish */
+	FCriticalSection WriteLock;
+
+	mutable FRWLock VersionLock;
+	FTCPClientSnapshot Current;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Sockets.h"
+#include "IPAddress.h"
+
+//Native unix domain sockets are only wired up for posix platforms
+#define TCPWRAPPER_WITH_UNIX_SOCKETS (PLATFORM_LINUX || PLATFORM_MAC)
+
+//Shared memory rings need eventfd and SCM_RIGHTS on a unix socket
+#define TCPWRAPPER_WITH_SHARED_MEMORY_RING PLATFORM_LINUX
+
+/**
+* Byte stream used by the TCP components. Hides whether the bytes travel over an
+* engine FSocket or a native unix domain socket so the receive loops stay the same.
+*/
+class TCPWRAPPER_API FTCPConnection
+{
+public:
+	FTCPConnection();
+	virtual ~FTCPConnection() {}
+
+	/** Unique for the lifetime of the process, tells connections apart in traces */
+	uint32 GetId() const { return Id; }
+
+	/** Connect to the endpoint this connection was created for. Returns false for accepted connections. */
+	virtual bool Connect() = 0;
+
+	virtual bool Send(const uint8* Data, int32 Count, int32& BytesSent) = 0;
+	virtual bool Recv(uint8* Data, int32 BufferSize, int32& BytesRead) = 0;
+	virtual bool HasPendingData(uint32& PendingDataSize) = 0;
+	virtual bool Wait(ESocketWaitConditions::Type Condition, FTimespan WaitTime) = 0;
+	virtual ESocketConnectionState GetConnectionState() = 0;
+	virtual bool SetSendBufferSize(int32 Size, int32& NewSize) = 0;
+	virtual bool SetReceiveBufferSize(int32 Size, int32& NewSize) = 0;
+	virtual bool Shutdown(ESocketShutdownMode Mode) = 0;
+
+	/**
+	* Disconnect. Safe to call while another thread is using the connection: the socket is shut down
+	* straight away so blocked calls return, but the descriptor is only released with the last reference.
+	*/
+	virtual bool Close() = 0;
+
+	/** Native descriptor if we own one directly, -1 for engine sockets */
+	virtual int32 GetNativeHandle() const { return -1; }
+
+	/**
+	* Wrap an engine socket. The connection takes ownership and destroys the socket via the socket subsystem.
+	*
+	* @param Socket		Socket to wrap
+	* @param RemoteAddress	Endpoint used by Connect(), may be null for accepted sockets
+	*/
+	static TSharedPtr<FTCPConnection, ESPMode::ThreadSafe> FromSocket(FSocket* Socket, TSharedPtr<FInternetAddr> RemoteAddress = nullptr);
+
+	/**
+	* Create an unconnected unix domain stream socket that will Connect() to given path.
+	* Returns null on platforms without unix domain socket support.
+	*/
+	static TSharedPtr<FTCPConnection, ESPMode::ThreadSafe> CreateUnixSocket(const FString& Path);
+
+	/**
+	* Create an unconnected shared memory ring connection. Connect() connects to the unix socket at Path
+	* and hands the server rings of RingSize bytes per direction. Returns null on platforms without support.
+	*/
+	static TSharedPtr<FTCPConnection, ESPMode::ThreadSafe> CreateSharedMemoryRing(const FString& Path, int32 RingSize);
+
+	/** Server side of CreateSharedMemoryRing, takes over an accepted unix socket once the client's rings arrive */
+	static TSharedPtr<FTCPConnection, ESPMode::ThreadSafe> AcceptSharedMemoryRing(TSharedPtr<FTCPConnection, ESPMode::ThreadSafe> UnixConnection);
+
+private:
+	uint32 Id;
+};
+
+typedef TSharedPtr<FTCPConnection, ESPMode::ThreadSafe> FTCPConnectionPtr;
@@ -3,17 +3,68 @@
 #include "Components/ActorComponent.h"
 #include "Networking.h"
 #include "IPAddress.h"
+#include "GenericPlatform/GenericPlatformFile.h"
+#include "TCPConnection.h"
+#include "TCPClientRegistry.h"
 #include "TCPServerComponent.generated.h"
 
 DECLARE_DYNAMIC_MULTICAST_DELEGATE(FTCPEventSignature);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FTCPMessageSignature, const TArray<uint8>&, Bytes);
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FTCPClientSignature, const FString&, Client);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FTCPFileSignature, const FString&, FilePath);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_ThreeParams(FTCPProgressSignature, int32, TransferId, int64, BytesTransferred, int64, TotalBytes);
+
+class FTCPServerSession;
+class FTCPMessageLanes;
+class FTCPAdaptiveBuffer;
+class FTCPBufferBudget;
+
+UENUM(BlueprintType)
+enum class ETCPMessagePriority : uint8
+{
+	Control,	//input, heartbeats and other small latency critical messages
+	Normal,
+	Bulk		//large transfers, yields to the other lanes every frame
+};
+
+UENUM(BlueprintType)
+enum class ETCPLaneScheduling : uint8
+{
+	Strict,		//always send from the highest priority lane that has data
+	Weighted	//share frames between lanes according to LaneWeights
+};
+
+USTRUCT(BlueprintType)
+struct FTCPMemoryStats
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadOnly, Category = "TCP Memory Stats")
+	int32 Connections = 0;
+
+	/** Bytes requested for kernel socket send/receive buffers */
+	UPROPERTY(BlueprintReadOnly, Category = "TCP Memory Stats")
+	int64 KernelBufferBytes = 0;
+
+	/** Bytes held by our own receive, reassembly and queued send buffers */
+	UPROPERTY(BlueprintReadOnly, Category = "TCP Memory Stats")
+	int64 UserBufferBytes = 0;
+
+	/** 0 if unlimited */
+	UPROPERTY(BlueprintReadOnly, Category = "TCP Memory Stats")
+	int64 MemoryBudget = 0;
+};
 
 struct FTCPClient
 {
-	FSocket* Socket;
+	FTCPConnectionPtr Connection;
+	TSharedPtr<FTCPMessageLanes, ESPMode::ThreadSafe> Lanes;
+	TSharedPtr<FTCPAdaptiveBuffer, ESPMode::ThreadSafe> Buffers;
 	FString Address;
 
+	/** Held for every send on Connection so emits from other threads can't interleave bytes with the server thread */
+	FCriticalSection SendLock;
+
 	bool operator==(const FTCPClient& Other)
 	{
 		return Address == Other.Address;
@@ -36,10 +87,17 @@ public:
 	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
 	FTCPEventSignature OnListenBegin;
 
-	/** Called after receiving socket has been closed. */
+	/**
+	* Called when StopListenServer stops the server. The listen socket is closed on the server thread
+	* right after and clients keep draining until OnShutdownComplete.
+	*/
 	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
 	FTCPEventSignature OnListenEnd;
 
+	/** Called once StopListenServer has finished flushing and closing every client connection */
+	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
+	FTCPEventSignature OnShutdownComplete;
+
 	/** Callback when we start listening on the TCP receive socket*/
 	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
 	FTCPClientSignature OnClientConnected;
@@ -48,6 +106,18 @@ public:
 	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
 	FTCPClientSignature OnClientDisconnected;
 
+	/** A streamed transfer was fully written to ReceiveFileDirectory */
+	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
+	FTCPFileSignature OnReceivedFile;
+
+	/** Progress of an EmitFile/EmitStream transfer, reported about every percent */
+	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
+	FTCPProgressSignature OnSendProgress;
+
+	/** Progress of an incoming streamed transfer, reported about every percent */
+	UPROPERTY(BlueprintAssignable, Category = "TCP Events")
+	FTCPProgressSignature OnReceiveProgress;
+
 	/** Default connection port e.g. 3001*/
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
 	int32 ListenPort;
@@ -55,10 +125,52 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
 	FString ListenSocketName;
 
-	/** in bytes */
+	/** Listen on a unix domain socket at UnixSocketPath instead of a TCP port. For same-host peers on Linux/Mac only. */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	bool bUseUnixDomainSocket;
+
+	/** Filesystem path of the unix domain socket e.g. /tmp/ue4-tcp.sock */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	FString UnixSocketPath;
+
+	/**
+	* Exchange bytes through shared memory rings instead of the socket, which is then only used to set them up.
+	* Needs bUseUnixDomainSocket and the same setting on the peer. Linux only.
+	*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	bool bUseSharedMemoryRing;
+
+	/** in bytes, upper bound per connection buffer */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
 	int32 BufferMaxSize;
 
+	/**
+	* Size socket buffers per connection from observed throughput instead of always reserving BufferMaxSize.
+	* Setting sizes turns off Linux's own buffer autotuning and the receive window is mostly fixed at connect,
+	* so on high bandwidth-delay links (round trip longer than BufferTargetLatency) turn this off instead.
+	*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	bool bAdaptiveBufferSizing;
+
+	/** in bytes, buffers start here and idle connections shrink back to it */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	int32 MinBufferSize;
+
+	/** Seconds of observed throughput the socket buffers should be able to hold, buffers only grow while this is longer than the round trip */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	float BufferTargetLatency;
+
+	/**
+	* Socket buffer growth + queued sends this component may use across all connections, Emit fails once it's used up.
+	* Each connection's MinBufferSize buffers are always granted on top of this. 0 for unlimited
+	*/
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	int32 MemoryBudgetMB;
+
+	/** Seconds StopListenServer keeps flushing queued sends and waiting for clients to close before dropping them */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	float ShutdownTimeout;
+
 	/** If true will auto-listen on begin play to port specified for receiving TCP messages. */
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
 	bool bShouldAutoListen;
@@ -86,6 +198,29 @@ public:
 	UPROPERTY(BlueprintReadOnly, Category = "TCP Connection Properties")
 	bool bIsConnected;
 
+	/** Frame messages into priority lanes so small control messages don't queue behind bulk transfers. Both peers must enable this. */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	bool bUsePriorityLanes;
+
+	/** Max payload bytes per lane frame, smaller frames interleave lanes more finely at the cost of more headers */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	int32 LaneFrameSize;
+
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	ETCPLaneScheduling LaneScheduling;
+
+	/** Relative frame share of the Control, Normal and Bulk lanes when using weighted scheduling */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	TArray<int32> LaneWeights;
+
+	/** Streamed transfers from framed peers are written to files here. Without it they are refused (read and dropped). */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	FString ReceiveFileDirectory;
+
+	/** in bytes, framed messages larger than this are dropped instead of being reassembled in memory */
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "TCP Connection Properties")
+	int32 MaxReceiveMessageSize;
+
 	/** 
 	* Start listening at given port for TCP messages. Will auto-listen on begin play by default
 	*/
@@ -94,6 +229,7 @@ public:
 
 	/**
 	* Close the receiving socket. This is usually automatically done on end play.
+	* Returns straight away, client connections are flushed and closed in the background until OnShutdownComplete.
 	*/
 	UFUNCTION(BlueprintCallable, Category = "TCP Functions")
 	void StopListenServer();
@@ -103,9 +239,32 @@ public:
 	*
 	* @param Message	Bytes
 	* @param ToClient	Client Address and port, obtained from connection event or 'All' for multicast
+	* @param Priority	Lane to send on, only used with bUsePriorityLanes
+	* @return false if the send failed or queueing it would go over MemoryBudgetMB
+	*/
+	UFUNCTION(BlueprintCallable, Category = "TCP Functions")
+	bool Emit(const TArray<uint8>& Bytes, const FString& ToClient = TEXT("All"), ETCPMessagePriority Priority = ETCPMessagePriority::Normal);
+
+	/**
+	* Stream a file to the TCP channel from the socket thread without loading it into memory.
+	*
+	* @param FilePath	File to send
+	* @param ToClient	Client Address and port, obtained from connection event or 'All' for multicast
+	* @param Priority	Lane to send on, only used with bUsePriorityLanes
+	* @return transfer id reported by OnSendProgress, -1 if the file or client couldn't be found
 	*/
 	UFUNCTION(BlueprintCallable, Category = "TCP Functions")
-	bool Emit(const TArray<uint8>& Bytes, const FString& ToClient = TEXT("All"));
+	int32 EmitFile(const FString& FilePath, const FString& ToClient = TEXT("All"), ETCPMessagePriority Priority = ETCPMessagePriority::Bulk);
+
+	/**
+	* Stream the rest of an open file handle to a single client, takes ownership of the handle.
+	* @return transfer id reported by OnSendProgress, -1 if the client couldn't be found
+	*/
+	int32 EmitStream(TUniquePtr<IFileHandle> Handle, const FString& ToClient, ETCPMessagePriority Priority = ETCPMessagePriority::Bulk);
+
+	/** Current socket buffer memory use across all clients */
+	UFUNCTION(BlueprintPure, Category = "TCP Functions")
+	FTCPMemoryStats GetMemoryStats();
 
 	/** 
 	* Disconnects client on the next tick
@@ -120,10 +279,23 @@ public:
 	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 	
 protected:
-	TMap<FString, TSharedPtr<FTCPClient>> Clients;
-	FSocket* ListenSocket;
-	FThreadSafeBool bShouldListen;
-	TFuture<void> ServerFinishedFuture;
+	friend class FTCPServerSession;
+
+	/** OnClientDisconnected on the game thread, whichever thread noticed */
+	void BroadcastClientDisconnected(const FString& Address);
+
+	/** Send bytes to a single client directly or through its lanes */
+	bool EmitToClient(const FTCPClientPtr& Client, const TArray<uint8>& Bytes, ETCPMessagePriority Priority);
+
+	/** Current session, safe to call from any thread */
+	TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> GetSession() const;
+
+	/** State shared with the server thread while listening, the thread keeps it alive until it has drained */
+	TSharedPtr<FTCPServerSession, ESPMode::ThreadSafe> Session;
+	mutable FCriticalSection SessionLock;
+	FThreadSafeCounter TransferCount;
+	TSharedPtr<FTCPBufferBudget, ESPMode::ThreadSafe> BufferBudget;
+	FThreadSafeBool bIsShuttingDown;
 	TArray<uint8> PingData;
 
 	FString SocketDescription;
@@ -39,7 +39,8 @@ public class TCPWrapper : ModuleRules
 				"CoreUObject",
 				"Engine",
 				"Slate",
-				"SlateCore"
+				"SlateCore",
+				"TraceLog"
 				// ... add private dependencies that you statically link with here ...	
 			}
 			);